@@ -0,0 +1,404 @@
+//microbenchmarks for coroutine.h, one JSON object per line on stdout
+//
+//  g++ -std=c++14 -O2 -I.. benchmark.cpp -o benchmark -pthread
+//  g++ -std=c++14 -O2 -I.. -DCOROUTINE_BACKEND=COROUTINE_BACKEND_UCONTEXT benchmark.cpp -o benchmark_ucontext -pthread
+//  cl /std:c++14 /O2 /EHsc /I.. benchmark.cpp
+//
+//  ./benchmark [name]   runs only the benchmarks whose name contains name
+
+#include "coroutine.h"
+
+#include <cstdio>
+#include <cstring>
+#include <chrono>
+#include <string>
+#include <vector>
+
+namespace {
+
+const char *backend_name() {
+#if COROUTINE_BACKEND == COROUTINE_BACKEND_ASM
+    return "asm";
+#elif COROUTINE_BACKEND == COROUTINE_BACKEND_UCONTEXT
+    return "ucontext";
+#else
+    return "fiber";
+#endif
+}
+
+using Clock = std::chrono::steady_clock;
+
+double seconds_since(Clock::time_point start) {
+    return std::chrono::duration<double>(Clock::now() - start).count();
+}
+
+void report(const char *name, size_t operations, double seconds, const char *extra = "") {
+    std::printf("{\"benchmark\":\"%s\",\"backend\":\"%s\",\"operations\":%zu,\"seconds\":%.6f,"
+                "\"ns_per_op\":%.2f,\"ops_per_sec\":%.0f%s}\n",
+                name, backend_name(), operations, seconds, seconds * 1e9 / double(operations),
+                double(operations) / seconds, extra);
+    std::fflush(stdout);
+}
+
+//resident bytes of the process, 0 where it can not be read
+size_t resident_bytes() {
+#if defined(__linux__)
+    FILE *file = std::fopen("/proc/self/statm", "r");
+    if (file == nullptr) {
+        return 0;
+    }
+    unsigned long pages = 0;
+    unsigned long resident = 0;
+    int read = std::fscanf(file, "%lu %lu", &pages, &resident);
+    std::fclose(file);
+    return read == 2 ? size_t(resident) * coroutine::page_size() : 0;
+#else
+    return 0;
+#endif
+}
+
+//one resume() plus one yield()
+void switch_pair() {
+    const size_t count = 2000000;
+    bool stop = false;
+    coroutine::routine_t id = coroutine::create([&stop] {
+        while (!stop) {
+            coroutine::yield();
+        }
+    });
+    coroutine::resume(id);
+
+    Clock::time_point start = Clock::now();
+    for (size_t i = 0; i < count; ++i) {
+        coroutine::resume(id);
+    }
+    double seconds = seconds_since(start);
+    stop = true;
+    coroutine::resume(id);
+    coroutine::destroy(id);
+    report("switch_pair", count, seconds);
+}
+
+//the same pair through the run loop's ready queue
+void run_loop_yield() {
+    const size_t count = 2000000;
+    coroutine::spawn([count] {
+        for (size_t i = 0; i < count; ++i) {
+            coroutine::yield();
+        }
+    });
+    Clock::time_point start = Clock::now();
+    coroutine::run();
+    report("run_loop_yield", count, seconds_since(start));
+}
+
+//create() and destroy() of 1M routines that never run, so no stack is taken
+void create_destroy() {
+    const size_t count = 1000000;
+    std::vector<coroutine::routine_t> ids(count);
+    Clock::time_point start = Clock::now();
+    for (size_t i = 0; i < count; ++i) {
+        ids[i] = coroutine::create([] {});
+    }
+    for (size_t i = 0; i < count; ++i) {
+        coroutine::destroy(ids[i]);
+    }
+    report("create_destroy", count, seconds_since(start));
+}
+
+//spawn() a routine, run it to completion, recycle block and stack
+void spawn_run() {
+    const size_t count = 1000000;
+    size_t done = 0;
+    Clock::time_point start = Clock::now();
+    for (size_t i = 0; i < count; i += 1000) {
+        for (size_t j = 0; j < 1000; ++j) {
+            coroutine::spawn([&done] {
+                ++done;
+            });
+        }
+        coroutine::run_until_idle();
+    }
+    report("spawn_run", done, seconds_since(start));
+}
+
+//two routines bouncing one message, ns per round trip
+void channel_ping_pong() {
+    const size_t count = 500000;
+    coroutine::Channel<int> ping(coroutine::Capacity(1));
+    coroutine::Channel<int> pong(coroutine::Capacity(1));
+    coroutine::spawn([&] {
+        for (size_t i = 0; i < count; ++i) {
+            ping.push(int(i));
+            pong.pop();
+        }
+    });
+    coroutine::spawn([&] {
+        for (size_t i = 0; i < count; ++i) {
+            pong.push(ping.pop());
+        }
+    });
+    Clock::time_point start = Clock::now();
+    coroutine::run();
+    report("channel_ping_pong", count, seconds_since(start));
+}
+
+//producer, two forwarding stages and a consumer on one thread
+void channel_pipeline() {
+    const size_t count = 2000000;
+    coroutine::Channel<size_t> first(coroutine::Capacity(256));
+    coroutine::Channel<size_t> second(coroutine::Capacity(256));
+    coroutine::Channel<size_t> third(coroutine::Capacity(256));
+    size_t sum = 0;
+    coroutine::spawn([&] {
+        for (size_t i = 0; i < count; ++i) {
+            first.push(i);
+        }
+    });
+    coroutine::spawn([&] {
+        for (size_t i = 0; i < count; ++i) {
+            second.push(first.pop() + 1);
+        }
+    });
+    coroutine::spawn([&] {
+        for (size_t i = 0; i < count; ++i) {
+            third.push(second.pop() + 1);
+        }
+    });
+    coroutine::spawn([&] {
+        for (size_t i = 0; i < count; ++i) {
+            sum += third.pop();
+        }
+    });
+    Clock::time_point start = Clock::now();
+    coroutine::run();
+    double seconds = seconds_since(start);
+    if (sum == 0) {
+        std::printf("pipeline lost its messages\n");
+    }
+    report("channel_pipeline", count, seconds);
+}
+
+//the pipeline again, moving batches with push_n()/pop_n()
+void channel_pipeline_batch() {
+    const size_t count = 2000000;
+    const size_t batch = 64;
+    coroutine::Channel<size_t> first(coroutine::Capacity(256));
+    coroutine::Channel<size_t> second(coroutine::Capacity(256));
+    size_t sum = 0;
+    coroutine::spawn([&] {
+        size_t items[batch];
+        for (size_t i = 0; i < count; i += batch) {
+            for (size_t j = 0; j < batch; ++j) {
+                items[j] = i + j;
+            }
+            first.push_n(items, batch);
+        }
+    });
+    coroutine::spawn([&] {
+        size_t items[batch];
+        for (size_t moved = 0; moved < count;) {
+            size_t n = first.pop_n(items, batch);
+            second.push_n(items, n);
+            moved += n;
+        }
+    });
+    coroutine::spawn([&] {
+        size_t items[batch];
+        for (size_t moved = 0; moved < count;) {
+            size_t n = second.pop_n(items, batch);
+            for (size_t j = 0; j < n; ++j) {
+                sum += items[j];
+            }
+            moved += n;
+        }
+    });
+    Clock::time_point start = Clock::now();
+    coroutine::run();
+    double seconds = seconds_since(start);
+    if (sum == 0) {
+        std::printf("pipeline lost its messages\n");
+    }
+    report("channel_pipeline_batch", count, seconds);
+}
+
+//the pipeline as generators pulled from a routine, one switch per stage and
+//value and back, no queue in between
+void generator_pipeline() {
+    const size_t count = 2000000;
+    size_t sum = 0;
+    coroutine::spawn([&sum, count] {
+        coroutine::Generator<size_t> first([count](coroutine::Yield<size_t>& yield) {
+            for (size_t i = 0; i < count; ++i) {
+                yield(i);
+            }
+        });
+        coroutine::Generator<size_t> second([&first](coroutine::Yield<size_t>& yield) {
+            for (size_t value : first) {
+                yield(value + 1);
+            }
+        });
+        coroutine::Generator<size_t> third([&second](coroutine::Yield<size_t>& yield) {
+            for (size_t value : second) {
+                yield(value + 1);
+            }
+        });
+        for (size_t value : third) {
+            sum += value;
+        }
+    });
+    Clock::time_point start = Clock::now();
+    coroutine::run();
+    double seconds = seconds_since(start);
+    if (sum == 0) {
+        std::printf("pipeline lost its messages\n");
+    }
+    report("generator_pipeline", count, seconds);
+}
+
+//pushes from another thread into a routine
+void channel_cross_thread() {
+    const size_t count = 1000000;
+    coroutine::Channel<size_t> channel(coroutine::Capacity(1024));
+    size_t sum = 0;
+    coroutine::spawn([&] {
+        for (size_t i = 0; i < count; ++i) {
+            sum += channel.pop();
+        }
+    });
+    Clock::time_point start = Clock::now();
+    std::thread producer([&] {
+        for (size_t i = 0; i < count; ++i) {
+            channel.push(i);
+        }
+    });
+    coroutine::run();
+    producer.join();
+    report("channel_cross_thread", count, seconds_since(start));
+}
+
+//another thread waking parked routines one by one, each wake goes through
+//the owner's mailbox
+void remote_wakeup() {
+    const size_t count = 1000000;
+    const size_t routines = 1000;
+    coroutine::Semaphore semaphore(0);
+    for (size_t i = 0; i < routines; ++i) {
+        coroutine::spawn([&semaphore, count, routines] {
+            for (size_t j = 0; j < count / routines; ++j) {
+                semaphore.acquire();
+            }
+        });
+    }
+    Clock::time_point start = Clock::now();
+    std::thread waker([&semaphore, count] {
+        for (size_t i = 0; i < count; ++i) {
+            semaphore.release();
+        }
+    });
+    coroutine::run();
+    waker.join();
+    report("remote_wakeup", count, seconds_since(start));
+}
+
+//round trip of an empty call through the await pool
+void await_overhead() {
+    const size_t count = 100000;
+    coroutine::spawn([count] {
+        for (size_t i = 0; i < count; ++i) {
+            coroutine::await([] {
+                return 0;
+            });
+        }
+    });
+    Clock::time_point start = Clock::now();
+    coroutine::run();
+    report("await_overhead", count, seconds_since(start));
+}
+
+//the same round trip through offload(), the call stays in the routine's frame
+void offload_overhead() {
+    const size_t count = 100000;
+    coroutine::spawn([count] {
+        for (size_t i = 0; i < count; ++i) {
+            coroutine::offload(coroutine::io_pool(), [] {
+                return 0;
+            });
+        }
+    });
+    Clock::time_point start = Clock::now();
+    coroutine::run();
+    report("offload_overhead", count, seconds_since(start));
+}
+
+//resident memory of parked routines after they touched their stack once
+void idle_routines(const char *name, size_t count, const coroutine::RoutineOptions& options) {
+    size_t before = resident_bytes();
+    std::vector<coroutine::routine_t> ids;
+    ids.reserve(count);
+    Clock::time_point start = Clock::now();
+    for (size_t i = 0; i < count; ++i) {
+        ids.push_back(coroutine::spawn([] {
+            coroutine::park();
+        }, options));
+    }
+    coroutine::run_until_idle();
+    double seconds = seconds_since(start);
+    size_t after = resident_bytes();
+
+    char extra[96];
+    std::snprintf(extra, sizeof(extra), ",\"rss_bytes_per_routine\":%.0f",
+                  after > before ? double(after - before) / double(count) : 0.0);
+    report(name, count, seconds, extra);
+
+    for (coroutine::routine_t id : ids) {
+        coroutine::destroy(id);
+    }
+}
+
+void idle_private_stack() {
+    coroutine::RoutineOptions options;
+    options.stack_size = 64 * 1024;
+    //two mappings per stack, stay well below the default vm.max_map_count
+    idle_routines("idle_private_stack", 20000, options);
+}
+
+void idle_shared_stack() {
+    coroutine::RoutineOptions options;
+    options.shared_stack = true;
+    idle_routines("idle_shared_stack", 200000, options);
+}
+
+struct Benchmark {
+    const char *name;
+    void (*run)();
+};
+
+const Benchmark benchmarks[] = {
+    { "switch_pair", &switch_pair },
+    { "run_loop_yield", &run_loop_yield },
+    { "create_destroy", &create_destroy },
+    { "spawn_run", &spawn_run },
+    { "channel_ping_pong", &channel_ping_pong },
+    { "channel_pipeline", &channel_pipeline },
+    { "channel_pipeline_batch", &channel_pipeline_batch },
+    { "generator_pipeline", &generator_pipeline },
+    { "channel_cross_thread", &channel_cross_thread },
+    { "remote_wakeup", &remote_wakeup },
+    { "await_overhead", &await_overhead },
+    { "offload_overhead", &offload_overhead },
+    { "idle_private_stack", &idle_private_stack },
+    { "idle_shared_stack", &idle_shared_stack },
+};
+
+}
+
+int main(int argc, char **argv) {
+    const char *filter = argc > 1 ? argv[1] : "";
+    for (const Benchmark& benchmark : benchmarks) {
+        if (std::strstr(benchmark.name, filter) != nullptr) {
+            benchmark.run();
+        }
+    }
+    return 0;
+}
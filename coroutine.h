@@ -24,6 +24,86 @@
 #define STACK_LIMIT (1024*1024)
 #endif
 
+//max number of released stacks kept per thread for reuse
+#ifndef STACK_POOL_LIMIT
+#define STACK_POOL_LIMIT 64
+#endif
+
+//size of the per-thread stack that shared-stack routines run on
+#ifndef SHARED_STACK_LIMIT
+#define SHARED_STACK_LIMIT (8*1024*1024)
+#endif
+
+//callables up to this size are stored inside the routine block itself
+#ifndef ROUTINE_INLINE_SIZE
+#define ROUTINE_INLINE_SIZE 64
+#endif
+
+//default number of elements a Channel holds before push() waits
+#ifndef CHANNEL_CAPACITY
+#define CHANNEL_CAPACITY 1024
+#endif
+
+//RoutineLocal slots kept inside the routine block, later ones spill to a vector
+#ifndef ROUTINE_LOCAL_SLOTS
+#define ROUTINE_LOCAL_SLOTS 8
+#endif
+
+//1 keeps the counters behind stats(), compiled out otherwise
+#ifndef COROUTINE_STATS
+#define COROUTINE_STATS 0
+#endif
+
+//1 times every run slice, for cpu_time() and Watchdog
+#ifndef COROUTINE_PROFILE
+#define COROUTINE_PROFILE 0
+#endif
+
+//1 measures how deep a private stack was used when it is released, by
+//scanning up from its base for the first byte written, and zeroes that part
+//again before the stack is pooled; otherwise only the depth at each yield()
+//is seen. Not available on the fiber backend.
+#ifndef COROUTINE_STACK_PAINT
+#define COROUTINE_STACK_PAINT 0
+#endif
+
+//threads that run await() calls, 0 takes max(4, hardware concurrency)
+#ifndef AWAIT_POOL_SIZE
+#define AWAIT_POOL_SIZE 0
+#endif
+
+//threads of cpu_pool(), each pinned to one core, 0 takes every core the
+//process may run on
+#ifndef CPU_POOL_SIZE
+#define CPU_POOL_SIZE 0
+#endif
+
+//context switch backends, define COROUTINE_BACKEND to one of them to override
+//the default: fibers on Windows, hand written switch on x86-64 and AArch64,
+//ucontext everywhere else
+#define COROUTINE_BACKEND_UCONTEXT 1
+#define COROUTINE_BACKEND_ASM 2
+#define COROUTINE_BACKEND_FIBER 3
+
+#ifndef COROUTINE_BACKEND
+#if defined(_MSC_VER)
+#define COROUTINE_BACKEND COROUTINE_BACKEND_FIBER
+#elif (defined(__x86_64__) || defined(__aarch64__)) && !defined(_WIN32)
+#define COROUTINE_BACKEND COROUTINE_BACKEND_ASM
+#else
+#define COROUTINE_BACKEND COROUTINE_BACKEND_UCONTEXT
+#endif
+#endif
+
+#if defined(_MSC_VER) != (COROUTINE_BACKEND == COROUTINE_BACKEND_FIBER)
+#error "the fiber backend is required on MSVC and only available there"
+#endif
+
+#if COROUTINE_BACKEND == COROUTINE_BACKEND_ASM && !defined(__x86_64__) && !defined(__aarch64__)
+#error "the asm backend supports x86-64 and AArch64 only"
+#endif
+
+#include <cstddef>
 #include <cstdint>
 #include <cstring>
 #include <cstdio>
@@ -35,6 +115,19 @@
 #include <thread>
 #include <memory>
 #include <future>
+#include <functional>
+#include <type_traits>
+#include <algorithm>
+#include <tuple>
+#include <utility>
+#include <exception>
+#include <system_error>
+#include <iterator>
+#include <new>
+#include <atomic>
+#include <mutex>
+#include <condition_variable>
+#include <chrono>
 
 using ::std::string;
 using ::std::wstring;
@@ -42,6 +135,7 @@ using ::std::wstring;
 #ifdef _MSC_VER
 #include <Windows.h>
 #else
+#if COROUTINE_BACKEND == COROUTINE_BACKEND_UCONTEXT
 #if defined(__APPLE__) && defined(__MACH__)
 #define _XOPEN_SOURCE
 #include <ucontext.h>
@@ -51,333 +145,6086 @@ using ::std::wstring;
 
 #endif
 #endif
+#include <unistd.h>
+#include <sys/mman.h>
+#include <poll.h>
+#include <fcntl.h>
+#include <sys/socket.h>
+#include <cerrno>
+#endif
 
-namespace coroutine {
+//I/O reactor backends, none on Windows
+#if defined(__linux__)
+#define COROUTINE_REACTOR_EPOLL 1
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sched.h>
+#include <pthread.h>
+#include <dirent.h>
+#elif defined(__APPLE__) || defined(__FreeBSD__)
+#define COROUTINE_REACTOR_KQUEUE 1
+#include <sys/event.h>
+#endif
 
-using routine_t = unsigned int;
+#if defined(COROUTINE_REACTOR_EPOLL) || defined(COROUTINE_REACTOR_KQUEUE)
+#define COROUTINE_REACTOR 1
+#endif
+
+//stackless Task<T> interop, C++20 only
+#if defined(__cpp_impl_coroutine) && (__cplusplus >= 202002L || (defined(_MSVC_LANG) && _MSVC_LANG >= 202002L))
+#define COROUTINE_TASK 1
+#include <coroutine>
+#endif
 
+#if COROUTINE_PROFILE && (defined(__x86_64__) || defined(_M_X64))
 #ifdef _MSC_VER
+#include <intrin.h>
+#else
+#include <x86intrin.h>
+#endif
+#endif
 
-struct Routine{
-    std::function<void()> func;
-    bool finished;
-    LPVOID fiber;
+#if defined(_MSC_VER)
+#define COROUTINE_NOINLINE __declspec(noinline)
+#else
+#define COROUTINE_NOINLINE __attribute__((noinline))
+#endif
 
-    Routine(std::function<void()> f)
-        :func(std::move(f))
-        ,finished(false)
-        ,fiber(nullptr){
-    }
+namespace coroutine {
+
+class Scheduler;
+struct Ordinator;
+struct Routine;
+
+//slot index + 1 in the low half, slot generation in the high half, so a
+//handle to a destroyed routine never matches whatever reuses its slot
+using routine_t = uint64_t;
+
+//snapshot returned by stats() and thread_stats()
+struct Stats {
+    //created and not destroyed yet
+    int64_t live;
+    //queued to run
+    int64_t runnable;
+    //suspended in park(), a channel, a lock, await(), a timer or I/O
+    int64_t waiting;
+    //ran to completion, not destroyed yet
+    int64_t finished;
+    //times a routine was switched in
+    int64_t switches;
+    //bytes mapped for stacks (pooled ones included) and the part of them
+    //routines were seen using at their switches, for the whole process
+    int64_t stack_reserved;
+    int64_t stack_committed;
+    //deepest any routine was seen using its stack, in bytes
+    int64_t stack_peak;
+    //most elements any Channel held at once
+    int64_t channel_high_water;
+    //await and offload pools: threads, calls running, calls queued, calls done
+    int64_t await_threads;
+    int64_t await_busy;
+    int64_t await_queued;
+    int64_t await_calls;
+};
 
-    ~Routine(){
-        DeleteFiber(fiber);
+#if COROUTINE_STATS
+
+//counters of one thread, written by that thread only. A gauge goes up on the
+//thread that sees a routine enter a state and down on the one that sees it
+//leave, so per thread they can go negative, only the sum is exact.
+struct ThreadStats {
+    std::atomic<int64_t> live;
+    std::atomic<int64_t> runnable;
+    std::atomic<int64_t> waiting;
+    std::atomic<int64_t> finished;
+    std::atomic<int64_t> switches;
+    std::atomic<int64_t> stack_peak;
+    std::atomic<int64_t> channel_high_water;
+
+    ThreadStats()
+        : live(0)
+        , runnable(0)
+        , waiting(0)
+        , finished(0)
+        , switches(0)
+        , stack_peak(0)
+        , channel_high_water(0) {
     }
 };
 
-struct Ordinator
-{
-    std::vector<std::shared_ptr<Routine>> routines;
-    std::list<routine_t> indexes;
-    routine_t current;
-    size_t stack_size;
-    LPVOID fiber;
+//plain load and store, no locked instruction: the owner is the only writer
+inline void stat_add(std::atomic<int64_t>& counter, int64_t count) {
+    counter.store(counter.load(std::memory_order_relaxed) + count, std::memory_order_relaxed);
+}
 
-    Ordinator(size_t ss = STACK_LIMIT)
-        : current(0)
-        , stack_size(ss)
-        , fiber(ConvertThreadToFiber(nullptr)){
+inline void stat_max(std::atomic<int64_t>& counter, int64_t value) {
+    if (value > counter.load(std::memory_order_relaxed)) {
+        counter.store(value, std::memory_order_relaxed);
     }
+}
 
-    ~Ordinator() = default;
-};
+//every live thread's counters plus what exited threads left behind
+struct StatsRegistry {
+    std::mutex mutex;
+    std::vector<ThreadStats *> threads;
+    ThreadStats retired;
+    //shared by all threads, changed with atomic adds
+    std::atomic<int64_t> stack_reserved;
+    std::atomic<int64_t> stack_committed;
+    std::atomic<int64_t> await_threads;
+    std::atomic<int64_t> await_busy;
+    std::atomic<int64_t> await_queued;
+    std::atomic<int64_t> await_calls;
 
-thread_local static Ordinator ordinator;
+    StatsRegistry()
+        : stack_reserved(0)
+        , stack_committed(0)
+        , await_threads(0)
+        , await_busy(0)
+        , await_queued(0)
+        , await_calls(0) {
+    }
+};
 
-inline routine_t create(std::function<void()> f){
-    auto routine = std::make_shared<Routine>(std::move(f));
+inline StatsRegistry& stats_registry() {
+    static StatsRegistry registry;
+    return registry;
+}
 
-    if (ordinator.indexes.empty()){
-        ordinator.routines.push_back(routine);
-        return ordinator.routines.size();
-    } else {
-        routine_t id = ordinator.indexes.front();
-        ordinator.indexes.pop_front();
-        assert(ordinator.routines[id-1] == nullptr);
-        ordinator.routines[id-1] = routine;
-        return id;
+//count = 1 when a stack is mapped, -1 when it is unmapped
+template<typename Stack>
+inline void stats_stack_mapped(const Stack& stack, int64_t count) {
+    StatsRegistry& registry = stats_registry();
+    registry.stack_reserved.fetch_add(count * int64_t(stack.size), std::memory_order_relaxed);
+    if (count < 0 && stack.touched != 0) {
+        registry.stack_committed.fetch_sub(int64_t(stack.touched), std::memory_order_relaxed);
     }
 }
 
-inline void destroy(routine_t id) {
-    auto routine = ordinator.routines[id-1];
-    assert(routine != nullptr);
-    
-    ordinator.routines[id-1].reset();
-    ordinator.indexes.push_back(id);
+//the pages down to used bytes below the top are committed now, and stay so while pooled
+template<typename Stack>
+inline void stats_stack_touched(Stack& stack, size_t used) {
+    if (used > stack.touched) {
+        stats_registry().stack_committed.fetch_add(int64_t(used - stack.touched), std::memory_order_relaxed);
+        stack.touched = used;
+    }
 }
 
-inline void __stdcall entry(LPVOID lpParameter) {
-    auto id = ordinator.current;
-    auto routine = ordinator.routines[id-1];
-    assert(routine != nullptr);
+#define COROUTINE_COUNT(ordinator, counter, count) stat_add((ordinator).stats.counter, (count))
 
-    routine->func();
+#else
 
-    routine->finished = true;
-    ordinator.current = 0;
+template<typename Stack>
+inline void stats_stack_mapped(const Stack&, int64_t) {
+}
 
-    SwitchToFiber(ordinator.fiber);
+template<typename Stack>
+inline void stats_stack_touched(Stack&, size_t) {
 }
 
-inline int resume(routine_t id) {
-    assert(ordinator.current == 0);
+#define COROUTINE_COUNT(ordinator, counter, count) ((void)0)
 
-    auto routine = ordinator.routines[id-1];
-    if (routine == nullptr)
-        return -1;
+#endif
 
-    if (routine->finished)
-        return -2;
+//cache line size assumed for padding, fields that different threads write
+//are kept at least this far apart
+const size_t kCacheLine = 64;
 
-    if (routine->fiber == nullptr) {
-        routine->fiber = CreateFiber(ordinator.stack_size, entry, 0);
-        ordinator.current = id;
-        SwitchToFiber(routine->fiber);
-    } else {
-        ordinator.current = id;
-        SwitchToFiber(routine->fiber);
+//NUMA node of every CPU, read once from sysfs on Linux; one node elsewhere
+//or when it can not be read
+struct Topology {
+    std::vector<int> cpu_nodes;
+    int nodes;
+};
+
+#if defined(__linux__)
+
+//cpulist files read like "0-15,32-47"
+inline void read_cpu_list(const char *path, int node, std::vector<int>& cpu_nodes) {
+    FILE *file = std::fopen(path, "r");
+    if (file == nullptr) {
+        return;
+    }
+    int first = 0;
+    while (std::fscanf(file, "%d", &first) == 1 && first >= 0) {
+        int last = first;
+        int separator = std::fgetc(file);
+        if (separator == '-') {
+            if (std::fscanf(file, "%d", &last) != 1) {
+                break;
+            }
+            separator = std::fgetc(file);
+        }
+        if (cpu_nodes.size() <= size_t(last)) {
+            cpu_nodes.resize(size_t(last) + 1, 0);
+        }
+        for (int cpu = first; cpu <= last; ++cpu) {
+            cpu_nodes[size_t(cpu)] = node;
+        }
+        if (separator != ',') {
+            break;
+        }
+    }
+    std::fclose(file);
+}
+
+#endif
+
+inline Topology read_topology() {
+    Topology found = { std::vector<int>(), 1 };
+#if defined(__linux__)
+    DIR *dir = opendir("/sys/devices/system/node");
+    if (dir == nullptr) {
+        return found;
+    }
+    int nodes = 0;
+    while (dirent *entry = readdir(dir)) {
+        int node = 0;
+        if (std::sscanf(entry->d_name, "node%d", &node) != 1) {
+            continue;
+        }
+        char path[96];
+        std::snprintf(path, sizeof(path), "/sys/devices/system/node/node%d/cpulist", node);
+        read_cpu_list(path, node, found.cpu_nodes);
+        ++nodes;
     }
+    closedir(dir);
+    found.nodes = std::max(nodes, 1);
+#endif
+    return found;
+}
+
+inline const Topology& topology() {
+    static const Topology cached = read_topology();
+    return cached;
+}
 
+//node of the CPU the calling thread runs on right now, 0 on one-node machines
+//without asking the kernel
+inline int current_node() {
+    const Topology& nodes = topology();
+    if (nodes.nodes <= 1) {
+        return 0;
+    }
+#if defined(__linux__)
+    const int cpu = sched_getcpu();
+    if (cpu >= 0 && size_t(cpu) < nodes.cpu_nodes.size()) {
+        return nodes.cpu_nodes[size_t(cpu)];
+    }
+#endif
     return 0;
 }
 
-inline void yield() {
-    routine_t id = ordinator.current;
-    auto routine = ordinator.routines[id-1];
-    assert(routine != nullptr);
+#ifdef _MSC_VER
+
+//a fiber owns its stack, so the fiber itself is what gets pooled
+struct Stack {
+    LPVOID fiber;
+    size_t size;
+    //bytes known to be committed, only tracked with COROUTINE_STATS
+    size_t touched;
+};
+
+inline void __stdcall entry(LPVOID lpParameter);
 
-    ordinator.current = 0;
-    SwitchToFiber(ordinator.fiber);
+//the fiber stack is only reserved, pages are committed as they are touched
+//and the system keeps a guard page below the committed part
+inline Stack stack_allocate(size_t size) {
+    Stack stack = { CreateFiberEx(0, size, FIBER_FLAG_FLOAT_SWITCH, entry, 0), size, 0 };
+    stats_stack_mapped(stack, 1);
+    return stack;
 }
 
-inline routine_t current() {
-    return ordinator.current;
+inline size_t stack_round(size_t size) {
+    return size;
+}
+
+inline void stack_free(Stack& stack) {
+    stats_stack_mapped(stack, -1);
+    DeleteFiber(stack.fiber);
+    stack.fiber = nullptr;
 }
 
+#else
 
-template<typename Function, typename ... Args>
-decltype(auto) await(Function &&func, Args && ... args){
-    auto future = std::async(std::launch::async, func, std::forward<Args>(args)...);
-    std::future_status status = future.wait_for(std::chrono::milliseconds(0));
+#if !defined(MAP_ANONYMOUS) && defined(MAP_ANON)
+#define MAP_ANONYMOUS MAP_ANON
+#endif
 
-    while (status == std::future_status::timeout)
-    {
-        if (ordinator.current != 0)
-            yield();
+#ifndef MAP_NORESERVE
+#define MAP_NORESERVE 0
+#endif
 
-        status = future.wait_for(std::chrono::milliseconds(0));
-    }
-    return future.get();
+//base is the lowest usable byte, the guard page sits right below it
+struct Stack {
+    char *base;
+    size_t size;
+    //bytes known to be committed, only tracked with COROUTINE_STATS
+    size_t touched;
+};
+
+inline size_t page_size() {
+    static const size_t size = size_t(sysconf(_SC_PAGESIZE));
+    return size;
 }
 
-#else
+inline size_t stack_round(size_t size) {
+    const size_t page = page_size();
+    return (size + page - 1) / page * page;
+}
 
-struct Routine {
-    std::function<void()> func;
-    char *stack;
-    bool finished;
-    ucontext_t ctx;
-    
-    Routine(std::function<void()> f)
-        : func(std::move(f))
-        , stack(nullptr)
-        , finished(false) {
-    }
-    
-    ~Routine() {
-        delete[] stack;
+//the mapping is only reserved, the kernel commits pages on first touch and
+//an overflow into the PROT_NONE guard page faults instead of corrupting memory
+inline Stack stack_allocate(size_t size) {
+    const size_t page = page_size();
+    size = stack_round(size);
+
+    void *addr = mmap(nullptr, size + page, PROT_READ | PROT_WRITE,
+                      MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (addr == MAP_FAILED) {
+        throw std::bad_alloc();
+    }
+    if (mprotect(addr, page, PROT_NONE) != 0) {
+        munmap(addr, size + page);
+        throw std::bad_alloc();
     }
+    Stack stack = { static_cast<char *>(addr) + page, size, 0 };
+    stats_stack_mapped(stack, 1);
+    return stack;
+}
+
+inline void stack_free(Stack& stack) {
+    if (stack.base == nullptr) {
+        return;
+    }
+    stats_stack_mapped(stack, -1);
+    const size_t page = page_size();
+    munmap(stack.base - page, stack.size + page);
+    stack.base = nullptr;
+}
+
+#endif
+
+struct PoolStats {
+    size_t hits;
+    size_t misses;
+    size_t cached;
 };
 
-struct Ordinator {
-    std::vector<std::shared_ptr<Routine>> routines;
-    std::list<routine_t> indexes;
-    routine_t current;
-    size_t stack_size;
-    ucontext_t ctx;
-    
-    inline Ordinator(size_t ss = STACK_LIMIT)
-        : current(0)
-        , stack_size(ss) {
+struct StackPool {
+    std::vector<Stack> stacks;
+    size_t limit;
+    size_t hits;
+    size_t misses;
+
+    StackPool(size_t l = STACK_POOL_LIMIT)
+        : limit(l)
+        , hits(0)
+        , misses(0) {
+    }
+
+    ~StackPool() {
+        trim(0);
+    }
+
+    //most recently released first, stacks of other sizes stay cached
+    inline Stack acquire(size_t size) {
+        size = stack_round(size);
+        for (size_t i = stacks.size(); i > 0; --i) {
+            if (stacks[i - 1].size == size) {
+                Stack stack = stacks[i - 1];
+                stacks[i - 1] = stacks.back();
+                stacks.pop_back();
+                ++hits;
+                return stack;
+            }
+        }
+        ++misses;
+        return stack_allocate(size);
+    }
+
+    inline void release(Stack& stack) {
+        if (stacks.size() < limit) {
+            stacks.push_back(stack);
+        } else {
+            stack_free(stack);
+        }
+    }
+
+    inline void trim(size_t count) {
+        while (stacks.size() > count) {
+            stack_free(stacks.back());
+            stacks.pop_back();
+        }
     }
-    
-    ~Ordinator() = default;
 };
 
-thread_local static Ordinator ordinator;
+#if COROUTINE_STACK_PAINT && !defined(_MSC_VER)
 
-inline routine_t create(std::function<void()> f) {
-    auto routine = std::make_shared<Routine>(std::move(f));
-    if (ordinator.indexes.empty()) {
-        ordinator.routines.push_back(routine);
-        return ordinator.routines.size();
-    } else {
-        routine_t id = ordinator.indexes.front();
-        ordinator.indexes.pop_front();
-        assert(ordinator.routines[id - 1] == nullptr);
-        ordinator.routines[id - 1] = routine;
-        return id;
+//a fresh mapping reads as zero, so the paint is free: the deepest byte used
+//is the first one that is not zero any more. Stack frames this deep always
+//hold a return address, a few zero bytes below it are lost to rounding.
+inline size_t stack_scan(const Stack& stack) {
+    const uint64_t *word = reinterpret_cast<const uint64_t *>(stack.base);
+    const uint64_t *top = reinterpret_cast<const uint64_t *>(stack.base + stack.size);
+    while (word != top && *word == 0) {
+        ++word;
     }
+    return size_t(top - word) * sizeof(uint64_t);
 }
 
-inline void destroy(routine_t id) {
-    auto routine = ordinator.routines[id - 1];
-    assert(routine != nullptr);
-    
-    ordinator.routines[id - 1].reset();
-    ordinator.indexes.push_back(id);
+#endif
+
+//what the routines of one tag were seen using, see set_adaptive_stacks()
+struct StackProfile {
+    const char *tag;
+    //routines measured and the most stack any of them used, in bytes
+    size_t samples;
+    size_t peak;
+};
+
+#if COROUTINE_STACK_PAINT && !defined(_MSC_VER)
+
+//adaptive sizing trusts a tag's peak after this many routines, and never
+//hands out less than kAdaptiveStackMin
+const size_t kAdaptiveStackSamples = 16;
+const size_t kAdaptiveStackMin = 16 * 1024;
+
+#endif
+
+//peaks of tagged routines of every thread, only touched when a tagged
+//routine releases its stack or, in adaptive mode, is created
+struct StackRegistry {
+    std::mutex mutex;
+    std::vector<StackProfile> profiles;
+#if COROUTINE_STACK_PAINT && !defined(_MSC_VER)
+    std::atomic<bool> adaptive;
+
+    StackRegistry()
+        : adaptive(false) {
+    }
+#endif
+
+    //tags are usually literals, the same text may still sit at two addresses
+    inline StackProfile *find(const char *tag) {
+        for (StackProfile& profile : profiles) {
+            if (profile.tag == tag || std::strcmp(profile.tag, tag) == 0) {
+                return &profile;
+            }
+        }
+        return nullptr;
+    }
+};
+
+inline StackRegistry& stack_registry() {
+    static StackRegistry registry;
+    return registry;
 }
 
-inline void entry() {
-    routine_t id = ordinator.current;
-    auto routine = ordinator.routines[id - 1];
-    routine->func();
-    
-    routine->finished = true;
-    ordinator.current = 0;
-    ordinator.indexes.push_back(id);
+inline void stack_record(const char *tag, size_t peak) {
+    StackRegistry& registry = stack_registry();
+    std::lock_guard<std::mutex> lock(registry.mutex);
+    StackProfile *profile = registry.find(tag);
+    if (profile == nullptr) {
+        registry.profiles.push_back(StackProfile{ tag, 1, peak });
+        return;
+    }
+    ++profile->samples;
+    profile->peak = std::max(profile->peak, peak);
 }
 
-inline int resume(routine_t id) {
-    assert(ordinator.current == 0);
-    
-    auto routine = ordinator.routines[id - 1];
-    if (routine == nullptr) {
-        return -1;
+//twice the tag's peak rounded up to a power of two, so few sizes are in use
+//and stacks pool well; fallback until the tag has enough samples. Only a
+//painted peak covers frames that never yield, so without painting a stack
+//sized from it could overflow and adaptive sizing is compiled out.
+inline size_t adaptive_stack_size(const char *tag, size_t fallback) {
+#if COROUTINE_STACK_PAINT && !defined(_MSC_VER)
+    StackRegistry& registry = stack_registry();
+    if (tag == nullptr || !registry.adaptive.load(std::memory_order_relaxed)) {
+        return fallback;
     }
-    
-    if (routine->finished) {
-        return -2;
+    size_t peak;
+    {
+        std::lock_guard<std::mutex> lock(registry.mutex);
+        StackProfile *profile = registry.find(tag);
+        if (profile == nullptr || profile->samples < kAdaptiveStackSamples) {
+            return fallback;
+        }
+        peak = profile->peak;
     }
-    
-    if (routine->stack == nullptr) {
-        getcontext(&routine->ctx);
-        
-        routine->stack = new char[ordinator.stack_size];
-        routine->ctx.uc_stack.ss_sp = routine->stack;
-        routine->ctx.uc_stack.ss_size = ordinator.stack_size;
-        routine->ctx.uc_link = &ordinator.ctx;
-        ordinator.current = id;
-        
-        makecontext(&routine->ctx, reinterpret_cast<void (*)(void)>(entry), 0);
-        swapcontext(&ordinator.ctx, &routine->ctx);
-    } else {
-        ordinator.current = id;
-        swapcontext(&ordinator.ctx, &routine->ctx);
+    size_t size = kAdaptiveStackMin;
+    while (size < 2 * peak && size < fallback) {
+        size *= 2;
     }
-    
-    return 0;
+    return std::min(size, fallback);
+#else
+    (void)tag;
+    return fallback;
+#endif
 }
 
-inline void yield() {
-    routine_t id = ordinator.current;
-    auto routine = ordinator.routines[id - 1];
-    assert(routine != nullptr);
-    
-    char *stack_top = routine->stack + ordinator.stack_size;
-    char stack_bottom = 0;
-    assert(size_t(stack_top - &stack_bottom) <= ordinator.stack_size);
-    
-    ordinator.current = 0;
-    swapcontext(&routine->ctx, &ordinator.ctx);
+#if COROUTINE_BACKEND == COROUTINE_BACKEND_FIBER
+
+struct Context {
+    LPVOID fiber;
+};
+
+inline void context_switch(Context& from, Context& to) {
+    SwitchToFiber(to.fiber);
 }
 
-inline routine_t current() {
-    return ordinator.current;
+#elif COROUTINE_BACKEND == COROUTINE_BACKEND_UCONTEXT
+
+struct Context {
+    ucontext_t uc;
+};
+
+inline void context_make(Context& ctx, Stack& stack, void (*func)()) {
+    getcontext(&ctx.uc);
+    ctx.uc.uc_stack.ss_sp = stack.base;
+    ctx.uc.uc_stack.ss_size = stack.size;
+    ctx.uc.uc_link = nullptr;
+    makecontext(&ctx.uc, func, 0);
 }
 
-template<typename Function, typename ... Args>
-decltype(auto) await(Function&& func, Args&& ... args) {
-    auto future = std::async(std::launch::async, func, std::forward<Args>(args)...);
-    std::future_status status = future.wait_for(std::chrono::milliseconds(0));
-    
-    while (status == std::future_status::timeout) {
-        if (ordinator.current != 0) {
-            yield();
-        }
-        
-        status = future.wait_for(std::chrono::milliseconds(0));
-    }
-    return future.get();
+inline void context_switch(Context& from, Context& to) {
+    swapcontext(&from.uc, &to.uc);
+}
+
+#else
+
+//only the callee-saved registers are kept, on the stack that is being left,
+//so a switch is a handful of moves and no syscall
+#if defined(__APPLE__)
+#define COROUTINE_ASM_FUNCTION(name) \
+    ".text\n.globl _" #name "\n.private_extern _" #name "\n.weak_definition _" #name "\n" \
+    ".p2align 4\n_" #name ":\n"
+#define COROUTINE_ASM_END(name) ""
+#define COROUTINE_ASM_SECTION_PUSH ""
+#define COROUTINE_ASM_SECTION_POP ""
+#else
+#define COROUTINE_ASM_FUNCTION(name) \
+    ".globl " #name "\n.hidden " #name "\n.weak " #name "\n" \
+    ".type " #name ",%function\n.p2align 4\n" #name ":\n"
+#define COROUTINE_ASM_END(name) ".size " #name ",.-" #name "\n"
+#define COROUTINE_ASM_SECTION_PUSH ".pushsection .text\n"
+#define COROUTINE_ASM_SECTION_POP ".popsection\n"
+#endif
+
+extern "C" void coroutine_switch_context(void **from, void *to);
+extern "C" void coroutine_start_context();
+
+#if defined(__x86_64__)
+
+__asm__(
+    COROUTINE_ASM_SECTION_PUSH
+    COROUTINE_ASM_FUNCTION(coroutine_switch_context)
+    "    pushq %rbp\n"
+    "    pushq %rbx\n"
+    "    pushq %r12\n"
+    "    pushq %r13\n"
+    "    pushq %r14\n"
+    "    pushq %r15\n"
+    "    subq $8, %rsp\n"
+    "    stmxcsr (%rsp)\n"
+    "    fnstcw 4(%rsp)\n"
+    "    movq %rsp, (%rdi)\n"
+    "    movq %rsi, %rsp\n"
+    "    ldmxcsr (%rsp)\n"
+    "    fldcw 4(%rsp)\n"
+    "    addq $8, %rsp\n"
+    "    popq %r15\n"
+    "    popq %r14\n"
+    "    popq %r13\n"
+    "    popq %r12\n"
+    "    popq %rbx\n"
+    "    popq %rbp\n"
+    "    ret\n"
+    COROUTINE_ASM_END(coroutine_switch_context)
+    COROUTINE_ASM_FUNCTION(coroutine_start_context)
+    "    callq *%rbx\n"
+    "    ud2\n"
+    COROUTINE_ASM_END(coroutine_start_context)
+    COROUTINE_ASM_SECTION_POP
+);
+
+#else
+
+__asm__(
+    COROUTINE_ASM_SECTION_PUSH
+    COROUTINE_ASM_FUNCTION(coroutine_switch_context)
+    "    sub sp, sp, #160\n"
+    "    stp x19, x20, [sp, #0]\n"
+    "    stp x21, x22, [sp, #16]\n"
+    "    stp x23, x24, [sp, #32]\n"
+    "    stp x25, x26, [sp, #48]\n"
+    "    stp x27, x28, [sp, #64]\n"
+    "    stp x29, x30, [sp, #80]\n"
+    "    stp d8, d9, [sp, #96]\n"
+    "    stp d10, d11, [sp, #112]\n"
+    "    stp d12, d13, [sp, #128]\n"
+    "    stp d14, d15, [sp, #144]\n"
+    "    mov x9, sp\n"
+    "    str x9, [x0]\n"
+    "    mov sp, x1\n"
+    "    ldp x19, x20, [sp, #0]\n"
+    "    ldp x21, x22, [sp, #16]\n"
+    "    ldp x23, x24, [sp, #32]\n"
+    "    ldp x25, x26, [sp, #48]\n"
+    "    ldp x27, x28, [sp, #64]\n"
+    "    ldp x29, x30, [sp, #80]\n"
+    "    ldp d8, d9, [sp, #96]\n"
+    "    ldp d10, d11, [sp, #112]\n"
+    "    ldp d12, d13, [sp, #128]\n"
+    "    ldp d14, d15, [sp, #144]\n"
+    "    add sp, sp, #160\n"
+    "    ret\n"
+    COROUTINE_ASM_END(coroutine_switch_context)
+    COROUTINE_ASM_FUNCTION(coroutine_start_context)
+    "    blr x19\n"
+    "    brk #0\n"
+    COROUTINE_ASM_END(coroutine_start_context)
+    COROUTINE_ASM_SECTION_POP
+);
+
+#endif
+
+struct Context {
+    void *sp;
+};
+
+//lay out a frame that coroutine_switch_context pops into
+//coroutine_start_context, which then calls func with an aligned stack
+inline void context_make(Context& ctx, Stack& stack, void (*func)()) {
+    uintptr_t top = uintptr_t(stack.base + stack.size) & ~uintptr_t(15);
+#if defined(__x86_64__)
+    void **frame = reinterpret_cast<void **>(top) - 10;
+    std::memset(frame, 0, 10 * sizeof(void *));
+    //default mxcsr and x87 control word
+    frame[0] = reinterpret_cast<void *>(uintptr_t(0x037F) << 32 | 0x1F80);
+    frame[5] = reinterpret_cast<void *>(func);
+    frame[7] = reinterpret_cast<void *>(coroutine_start_context);
+#else
+    void **frame = reinterpret_cast<void **>(top) - 20;
+    std::memset(frame, 0, 20 * sizeof(void *));
+    frame[0] = reinterpret_cast<void *>(func);
+    frame[11] = reinterpret_cast<void *>(coroutine_start_context);
+#endif
+    ctx.sp = frame;
+}
+
+inline void context_switch(Context& from, Context& to) {
+    coroutine_switch_context(&from.sp, to.sp);
 }
 
 #endif
 
-template<typename Type>
-class Channel {
+//ready queue class of a routine, a thread's run loop takes high before
+//normal before low, see pick_ready()
+enum class Priority : uint8_t {
+    high,
+    normal,
+    low
+};
+
+const size_t kPriorityCount = 3;
+
+//a class that waited while this many routines of higher ones ran gets the next turn
+const size_t kPriorityBurst = 8;
+
+class CancelToken;
+
+struct RoutineOptions {
+    //run on the thread's shared stack and keep only the used part of it
+    //in a private buffer while suspended, ignored by the fiber backend
+    bool shared_stack = false;
+    //private stack size in bytes, 0 takes the thread default (set_stack_size)
+    size_t stack_size = 0;
+    //creation site or kind of work, a string literal; named in Watchdog reports
+    const char *tag = nullptr;
+    //order in the thread's ready queue, Scheduler workers ignore it
+    Priority priority = Priority::normal;
+    //cancelled along with every other routine given the same token, which
+    //must outlive the routine
+    CancelToken *token = nullptr;
+};
+
+//cancel() for a group of routines, from any thread. Routines name it in
+//RoutineOptions::token; one created after the token fired starts out
+//cancelled.
+class CancelToken {
 public:
-    Channel()
-        : taker_(0) {
-        taker_ = 0;
+    CancelToken()
+        : cancelled_(false)
+        , head_(nullptr) {
+    }
+
+    CancelToken(const CancelToken&) = delete;
+    CancelToken& operator=(const CancelToken&) = delete;
+
+    inline void cancel();
+
+    inline bool cancelled() const {
+        return cancelled_.load(std::memory_order_acquire);
     }
-    
-    Channel(routine_t id)
-        : taker_(id) {
+
+    inline void attach(Routine *routine);
+    inline void detach(Routine *routine);
+
+private:
+    std::mutex mutex_;
+    std::atomic<bool> cancelled_;
+    //routines that named it, linked through token_next
+    Routine *head_;
+};
+
+class WaitQueue;
+
+//a routine, or a thread outside any routine, blocked in a WaitQueue. The one
+//of a routine lives in its control block, never on its stack, which may be
+//copied away (shared stack) while a waker on another thread links it.
+struct Waiter {
+    //nullptr for a thread, that sleeps on home's remote_cv until signaled
+    Routine *routine;
+    Ordinator *home;
+    //wait epoch the signal claims, see begin_wait()
+    uint64_t epoch;
+    Waiter *prev;
+    Waiter *next;
+    //a thread blocked in several queues (select) is signalled once, through
+    //the signaled flag of the first of its waiters
+    Waiter *group;
+    //set on the first waiter of a group to the one the signal came through
+    Waiter *woken;
+    //element claimed for this waiter by the side that woke it (Channel)
+    void *handoff;
+    size_t handoff_pos;
+    //queue a routine waits in and the lock guarding it, from when it links
+    //until it is done with the wait, so destroy() can take it out
+    WaitQueue *queue;
+    std::mutex *lock;
+    bool linked;
+    bool signaled;
+
+    Waiter()
+        : routine(nullptr)
+        , home(nullptr)
+        , epoch(0)
+        , prev(nullptr)
+        , next(nullptr)
+        , group(nullptr)
+        , woken(nullptr)
+        , handoff(nullptr)
+        , handoff_pos(0)
+        , queue(nullptr)
+        , lock(nullptr)
+        , linked(false)
+        , signaled(false) {
     }
-    
-    inline void consume(routine_t id) {
-        taker_ = id;
+};
+
+//FIFO of waiters, guarded by the lock of whatever owns it; waiting() may be
+//read without that lock to skip it when nobody waits
+class WaitQueue {
+public:
+    WaitQueue()
+        : head_(nullptr)
+        , tail_(nullptr)
+        , count_(0)
+        , owner_(nullptr)
+        , pass_on_(nullptr) {
     }
-    
-    inline void push(const Type& obj) {
-        list_.push_back(obj);
-        if (taker_ && taker_ != current()) {
-            resume(taker_);
+
+    WaitQueue(const WaitQueue&) = delete;
+    WaitQueue& operator=(const WaitQueue&) = delete;
+
+    inline void push_back(Waiter *waiter) {
+        assert(!waiter->linked);
+        waiter->linked = true;
+        waiter->next = nullptr;
+        waiter->prev = tail_;
+        if (tail_ != nullptr) {
+            tail_->next = waiter;
+        } else {
+            head_ = waiter;
         }
+        tail_ = waiter;
+        count_.store(count_.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
     }
-    
-    inline void push(Type&& obj) {
-        list_.push_back(std::move(obj));
-        if (taker_ && taker_ != current()) {
-            resume(taker_);
+
+    inline void remove(Waiter *waiter) {
+        assert(waiter->linked);
+        if (waiter->prev != nullptr) {
+            waiter->prev->next = waiter->next;
+        } else {
+            head_ = waiter->next;
+        }
+        if (waiter->next != nullptr) {
+            waiter->next->prev = waiter->prev;
+        } else {
+            tail_ = waiter->prev;
         }
+        waiter->prev = nullptr;
+        waiter->next = nullptr;
+        waiter->linked = false;
+        count_.store(count_.load(std::memory_order_relaxed) - 1, std::memory_order_relaxed);
     }
-    
-    inline Type pop() {
-        if (!taker_) {
-            taker_ = current();
-        }
-        
-        while (list_.empty())
-            yield();
-        
-        Type obj = std::move(list_.front());
-        list_.pop_front();
-        return std::move(obj);
-    }
-    
-    inline void clear() {
-        list_.clear();
+
+    inline Waiter *front() const {
+        return head_;
     }
-    
-    inline void touch() {
-        if (taker_ && taker_ != current()) {
-            resume(taker_);
+
+    inline Waiter *pop_front() {
+        Waiter *waiter = head_;
+        if (waiter != nullptr) {
+            remove(waiter);
         }
+        return waiter;
+    }
+
+    inline bool empty() const {
+        return head_ == nullptr;
     }
-    
-    inline size_t size() {
-        return list_.size();
+
+    inline size_t waiting() const {
+        return count_.load(std::memory_order_relaxed);
     }
-    
-    inline bool empty() {
-        return list_.empty();
+
+    //how a wakeup, and whatever its waker handed over with it, that went to a
+    //routine destroy()ed before it ran goes to the next waiter; called
+    //without the lock. By default the next waiter is signalled.
+    inline void set_pass_on(void *owner, void (*func)(void *, WaitQueue&, Waiter *)) {
+        owner_ = owner;
+        pass_on_ = func;
     }
 
+    inline void pass_on(Waiter *waiter, std::mutex& lock);
+
 private:
-    std::list<Type> list_;
-    routine_t taker_;
+    Waiter *head_;
+    Waiter *tail_;
+    std::atomic<size_t> count_;
+    void *owner_;
+    void (*pass_on_)(void *, WaitQueue&, Waiter *);
+};
+
+//value of one RoutineLocal, created on first use and freed with its owner
+struct LocalSlot {
+    void *value;
+    void (*dispose)(void *);
 };
 
+//RoutineLocal values of a routine (or of a thread's main context), indexed by
+//RoutineLocal::index()
+class LocalSlots {
+public:
+    LocalSlots() {
+        for (size_t i = 0; i < ROUTINE_LOCAL_SLOTS; ++i) {
+            inline_[i] = LocalSlot{ nullptr, nullptr };
+        }
+    }
+
+    ~LocalSlots() {
+        clear();
+    }
+
+    LocalSlots(const LocalSlots&) = delete;
+    LocalSlots& operator=(const LocalSlots&) = delete;
+
+    inline LocalSlot& at(size_t index) {
+        if (index < ROUTINE_LOCAL_SLOTS) {
+            return inline_[index];
+        }
+        index -= ROUTINE_LOCAL_SLOTS;
+        if (index >= overflow_.size()) {
+            overflow_.resize(index + 1, LocalSlot{ nullptr, nullptr });
+        }
+        return overflow_[index];
+    }
+
+    inline void clear() {
+        for (size_t i = 0; i < ROUTINE_LOCAL_SLOTS; ++i) {
+            reset(inline_[i]);
+        }
+        for (LocalSlot& slot : overflow_) {
+            reset(slot);
+        }
+    }
+
+    static inline void reset(LocalSlot& slot) {
+        if (slot.value != nullptr) {
+            void *value = slot.value;
+            slot.value = nullptr;
+            slot.dispose(value);
+        }
+    }
+
+private:
+    LocalSlot inline_[ROUTINE_LOCAL_SLOTS];
+    std::vector<LocalSlot> overflow_;
+};
+
+struct Routine {
+    //type-erased callable, kept in storage or on the heap when too big
+    void (*invoke)(Routine *);
+    void (*dispose)(Routine *);
+    typename std::aligned_storage<ROUTINE_INLINE_SIZE, alignof(std::max_align_t)>::type storage;
+    routine_t id;
+    //set for routines spawned on a Scheduler, they do not live in a slot
+    Scheduler *scheduler;
+    //intrusive links for run queues
+    Routine *next;
+    Routine *prev;
+    Stack stack;
+    size_t stack_size;
+    //deepest it was seen on its stack, in bytes
+    size_t stack_peak;
+    bool finished;
+    bool shared;
+    //started by spawn(), destroyed by the run loop once finished
+    bool detached;
+    Priority priority;
+    //linked into the thread's ready queue
+    bool queued;
+    //epoch, reason, kind and phase of the current wait, see begin_wait()
+    std::atomic<uint64_t> wait_state;
+    //suspended in a wait, only the wait's waker hands it back
+    bool waiting;
+    //scheduled routines: NUMA nodes of the thread that allocated the block
+    //and of the worker that took its stack, first touch put the pages there
+    int node;
+    int stack_node;
+    //timed waits: deadline, position in the timer heap and the wait it ends
+    std::chrono::steady_clock::time_point deadline;
+    size_t timer_index;
+    uint64_t timer_epoch;
+    //node for the WaitQueue it blocks in, and more of them for select()
+    Waiter waiter;
+    std::unique_ptr<Waiter[]> select_waiters;
+    size_t select_capacity;
+    //futures still to finish before the routine is woken from a join
+    size_t join_pending;
+    //set while it waits on something other than a WaitQueue that destroy()
+    //must let go of, called with leave_arg; see leave_wait()
+    void (*leave)(Routine *, void *);
+    void *leave_arg;
+    //RoutineLocal values, they move with the routine between workers
+    LocalSlots locals;
+    //thread that created it, nullptr for scheduled routines
+    Ordinator *home;
+    const char *tag;
+    //RoutineOptions::token and the links of its list
+    CancelToken *token;
+    Routine *token_prev;
+    Routine *token_next;
+    //generators pulled from inside a routine switch back to it, not to the
+    //main context, see pull()
+    Routine *puller;
+#if COROUTINE_PROFILE
+    //sum of its run slices, see cpu_ticks()
+    uint64_t cpu_ticks;
+#endif
+    Context ctx;
+    //shared-stack routines only: probe taken at the last yield and the
+    //live part of the shared stack saved while another routine owns it
+    char *stack_sp;
+    std::unique_ptr<char[]> save_buffer;
+    size_t save_size;
+    size_t save_capacity;
+
+    Routine(const RoutineOptions& options)
+        : invoke(nullptr)
+        , dispose(nullptr)
+        , id(0)
+        , scheduler(nullptr)
+        , next(nullptr)
+        , prev(nullptr)
+        , stack()
+        , stack_size(options.stack_size)
+        , stack_peak(0)
+        , finished(false)
+        , shared(options.shared_stack)
+        , detached(false)
+        , priority(options.priority)
+        , queued(false)
+        , wait_state(0)
+        , waiting(false)
+        , node(0)
+        , stack_node(0)
+        , deadline()
+        , timer_index(SIZE_MAX)
+        , timer_epoch(0)
+        , select_capacity(0)
+        , join_pending(0)
+        , leave(nullptr)
+        , leave_arg(nullptr)
+        , home(nullptr)
+        , tag(options.tag)
+        , token(options.token)
+        , token_prev(nullptr)
+        , token_next(nullptr)
+        , puller(nullptr)
+#if COROUTINE_PROFILE
+        , cpu_ticks(0)
+#endif
+        , ctx()
+        , stack_sp(nullptr)
+        , save_size(0)
+        , save_capacity(0) {
+#if COROUTINE_BACKEND == COROUTINE_BACKEND_FIBER
+        shared = false;
+#endif
+        if (token != nullptr) {
+            token->attach(this);
+        }
+    }
+
+    ~Routine() {
+        if (token != nullptr) {
+            token->detach(this);
+        }
+        locals.clear();
+        if (dispose != nullptr) {
+            dispose(this);
+        }
+    }
+
+    inline void *data() {
+        return &storage;
+    }
+
+    //the callable bind() stored, Callable must be its decayed type
+    template<typename Callable>
+    inline Callable *target() {
+        if (invoke == &invoke_inline<Callable>) {
+            return static_cast<Callable *>(data());
+        }
+        return *static_cast<Callable **>(data());
+    }
+
+    template<typename Callable>
+    static void invoke_inline(Routine *routine) {
+        (*static_cast<Callable *>(routine->data()))();
+    }
+
+    template<typename Callable>
+    static void dispose_inline(Routine *routine) {
+        static_cast<Callable *>(routine->data())->~Callable();
+    }
+
+    template<typename Callable>
+    static void invoke_heap(Routine *routine) {
+        (**static_cast<Callable **>(routine->data()))();
+    }
+
+    template<typename Callable>
+    static void dispose_heap(Routine *routine) {
+        delete *static_cast<Callable **>(routine->data());
+    }
+
+    template<typename Callable, typename Function>
+    inline void bind(Function&& func, std::true_type) {
+        new (data()) Callable(std::forward<Function>(func));
+        invoke = &invoke_inline<Callable>;
+        dispose = &dispose_inline<Callable>;
+    }
+
+    template<typename Callable, typename Function>
+    inline void bind(Function&& func, std::false_type) {
+        new (data()) Callable *(new Callable(std::forward<Function>(func)));
+        invoke = &invoke_heap<Callable>;
+        dispose = &dispose_heap<Callable>;
+    }
+
+    template<typename Function>
+    inline void bind(Function&& func) {
+        using Callable = typename std::decay<Function>::type;
+        using Inline = std::integral_constant<bool, sizeof(Callable) <= sizeof(storage)
+                                                    && alignof(Callable) <= alignof(std::max_align_t)>;
+        bind<Callable>(std::forward<Function>(func), Inline());
+    }
+};
+
+//routine blocks are carved out of chunks and recycled through a free list,
+//so creating a routine does not touch the heap once the arena is warm
+class RoutineArena {
+public:
+    RoutineArena()
+        : free_(nullptr) {
+    }
+
+    RoutineArena(const RoutineArena&) = delete;
+    RoutineArena& operator=(const RoutineArena&) = delete;
+
+    inline void *allocate() {
+        if (free_ == nullptr) {
+            grow();
+        }
+        Block *block = free_;
+        free_ = block->next;
+        return block;
+    }
+
+    inline void release(void *ptr) {
+        Block *block = static_cast<Block *>(ptr);
+        block->next = free_;
+        free_ = block;
+    }
+
+private:
+    union Block {
+        Block *next;
+        typename std::aligned_storage<sizeof(Routine), alignof(Routine)>::type data;
+    };
+
+    static constexpr size_t kChunkSize = 64;
+
+    inline void grow() {
+        chunks_.emplace_back(new Block[kChunkSize]);
+        Block *chunk = chunks_.back().get();
+        for (size_t i = kChunkSize; i > 0; --i) {
+            release(&chunk[i - 1]);
+        }
+    }
+
+    std::vector<std::unique_ptr<Block[]>> chunks_;
+    Block *free_;
+};
+
+//4-ary min-heap of routines ordered by deadline, every routine keeps its own
+//index so a cancelled wait leaves the heap in O(log n) without a search
+class TimerHeap {
+public:
+    static constexpr size_t npos = SIZE_MAX;
+
+    inline bool empty() const {
+        return heap_.empty();
+    }
+
+    inline size_t size() const {
+        return heap_.size();
+    }
+
+    inline Routine *top() const {
+        return heap_.front();
+    }
+
+    inline void push(Routine *routine) {
+        assert(routine->timer_index == npos);
+        routine->timer_index = heap_.size();
+        heap_.push_back(routine);
+        sift_up(routine->timer_index);
+    }
+
+    //no-op if the routine is not in the heap
+    inline void remove(Routine *routine) {
+        size_t index = routine->timer_index;
+        if (index == npos) {
+            return;
+        }
+        assert(heap_[index] == routine);
+        routine->timer_index = npos;
+
+        Routine *last = heap_.back();
+        heap_.pop_back();
+        if (last == routine) {
+            return;
+        }
+        heap_[index] = last;
+        last->timer_index = index;
+        if (index > 0 && earlier(last, heap_[(index - 1) / kArity])) {
+            sift_up(index);
+        } else {
+            sift_down(index);
+        }
+    }
+
+private:
+    static constexpr size_t kArity = 4;
+
+    static inline bool earlier(const Routine *a, const Routine *b) {
+        return a->deadline < b->deadline;
+    }
+
+    inline void place(size_t index, Routine *routine) {
+        heap_[index] = routine;
+        routine->timer_index = index;
+    }
+
+    inline void sift_up(size_t index) {
+        Routine *routine = heap_[index];
+        while (index > 0) {
+            size_t parent = (index - 1) / kArity;
+            if (!earlier(routine, heap_[parent])) {
+                break;
+            }
+            place(index, heap_[parent]);
+            index = parent;
+        }
+        place(index, routine);
+    }
+
+    inline void sift_down(size_t index) {
+        Routine *routine = heap_[index];
+        const size_t count = heap_.size();
+        for (;;) {
+            size_t first = index * kArity + 1;
+            if (first >= count) {
+                break;
+            }
+            size_t best = first;
+            size_t end = std::min(first + kArity, count);
+            for (size_t child = first + 1; child < end; ++child) {
+                if (earlier(heap_[child], heap_[best])) {
+                    best = child;
+                }
+            }
+            if (!earlier(heap_[best], routine)) {
+                break;
+            }
+            place(index, heap_[best]);
+            index = best;
+        }
+        place(index, routine);
+    }
+
+    std::vector<Routine *> heap_;
+};
+
+#if COROUTINE_PROFILE
+
+//a cheap monotonic tick: the TSC on x86-64, the virtual counter on AArch64,
+//steady_clock nanoseconds elsewhere
+inline uint64_t cpu_ticks() {
+#if defined(__x86_64__) || defined(_M_X64)
+    return __rdtsc();
+#elif defined(__aarch64__)
+    uint64_t ticks;
+    __asm__ __volatile__("mrs %0, cntvct_el0" : "=r"(ticks));
+    return ticks;
+#else
+    return uint64_t(std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::steady_clock::now().time_since_epoch()).count());
+#endif
+}
+
+//ticks per nanosecond; the TSC is measured against steady_clock once, which
+//takes the first caller about 10 ms
+inline double ticks_per_ns() {
+    static const double rate = [] {
+#if defined(__x86_64__) || defined(_M_X64)
+        auto begin = std::chrono::steady_clock::now();
+        uint64_t first = cpu_ticks();
+        std::this_thread::sleep_for(std::chrono::milliseconds(10));
+        uint64_t last = cpu_ticks();
+        auto elapsed = std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - begin);
+        return double(last - first) / double(elapsed.count());
+#elif defined(__aarch64__)
+        uint64_t frequency;
+        __asm__ __volatile__("mrs %0, cntfrq_el0" : "=r"(frequency));
+        return double(frequency) / 1e9;
+#else
+        return 1.0;
+#endif
+    }();
+    return rate;
+}
+
+inline std::chrono::nanoseconds ticks_to_duration(uint64_t ticks) {
+    return std::chrono::nanoseconds(int64_t(double(ticks) / ticks_per_ns()));
+}
+
+//the routine a thread is running right now, published for Watchdog
+struct Slice {
+    //cpu_ticks() when it was switched in, 0 while none runs
+    std::atomic<uint64_t> start;
+    //bumped at every switch, so a report names one slice only once
+    std::atomic<uint64_t> serial;
+    std::atomic<routine_t> id;
+    std::atomic<const char *> tag;
+    std::thread::id thread;
+
+    Slice()
+        : start(0)
+        , serial(0)
+        , id(0)
+        , tag(nullptr)
+        , thread(std::this_thread::get_id()) {
+    }
+};
+
+//slices of every thread that has an Ordinator
+struct SliceRegistry {
+    std::mutex mutex;
+    std::vector<Slice *> slices;
+};
+
+inline SliceRegistry& slice_registry() {
+    static SliceRegistry registry;
+    return registry;
+}
+
+#endif
+
+//free slots chain through next_free (index + 1, 0 ends the list)
+struct Slot {
+    Routine *routine;
+    uint32_t generation;
+    uint32_t next_free;
+};
+
+#ifdef COROUTINE_REACTOR
+
+//per-thread readiness poller: a routine waiting for a descriptor is armed
+//one-shot and handed back by poll(), at most one reader and one writer per fd
+class Reactor {
+public:
+    Reactor()
+        : waiting_(0) {
+#ifdef COROUTINE_REACTOR_EPOLL
+        poller_ = epoll_create1(EPOLL_CLOEXEC);
+        if (poller_ < 0) {
+            throw std::system_error(errno, std::system_category(), "epoll_create1");
+        }
+        wakeup_ = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        if (wakeup_ < 0) {
+            int error = errno;
+            ::close(poller_);
+            throw std::system_error(error, std::system_category(), "eventfd");
+        }
+        epoll_event event = {};
+        event.events = EPOLLIN;
+        event.data.fd = wakeup_;
+        epoll_ctl(poller_, EPOLL_CTL_ADD, wakeup_, &event);
+#else
+        poller_ = kqueue();
+        if (poller_ < 0) {
+            throw std::system_error(errno, std::system_category(), "kqueue");
+        }
+        fcntl(poller_, F_SETFD, FD_CLOEXEC);
+        struct kevent change;
+        EV_SET(&change, 0, EVFILT_USER, EV_ADD | EV_CLEAR, 0, 0, nullptr);
+        kevent(poller_, &change, 1, nullptr, 0, nullptr);
+#endif
+    }
+
+    ~Reactor() {
+#ifdef COROUTINE_REACTOR_EPOLL
+        ::close(wakeup_);
+#endif
+        ::close(poller_);
+    }
+
+    Reactor(const Reactor&) = delete;
+    Reactor& operator=(const Reactor&) = delete;
+
+    //arm fd for routine, -1 with errno set if the descriptor can not be
+    //polled, EBUSY if another routine already waits on it the same way
+    inline int add(Routine *routine, int fd, bool write) {
+        assert(fd >= 0);
+        if (size_t(fd) >= interests_.size()) {
+            interests_.resize(size_t(fd) + 1, Interest{ nullptr, nullptr });
+        }
+        Interest& interest = interests_[size_t(fd)];
+        Routine *& slot = write ? interest.writer : interest.reader;
+        //one waiter per descriptor and direction
+        if (slot != nullptr) {
+            errno = EBUSY;
+            return -1;
+        }
+        slot = routine;
+
+#ifdef COROUTINE_REACTOR_EPOLL
+        if (arm(fd, interest) != 0) {
+#else
+        struct kevent change;
+        EV_SET(&change, fd, write ? EVFILT_WRITE : EVFILT_READ, EV_ADD | EV_ONESHOT, 0, 0, nullptr);
+        if (kevent(poller_, &change, 1, nullptr, 0, nullptr) < 0) {
+#endif
+            slot = nullptr;
+            return -1;
+        }
+        ++waiting_;
+        return 0;
+    }
+
+    //disarm fd for routine unless poll() handed it back already (cancel())
+    inline void remove(Routine *routine, int fd, bool write) {
+        Interest& interest = interests_[size_t(fd)];
+        Routine *& slot = write ? interest.writer : interest.reader;
+        if (slot != routine) {
+            return;
+        }
+        slot = nullptr;
+        --waiting_;
+#ifdef COROUTINE_REACTOR_EPOLL
+        arm(fd, interest);
+#else
+        struct kevent change;
+        EV_SET(&change, fd, write ? EVFILT_WRITE : EVFILT_READ, EV_DELETE, 0, 0, nullptr);
+        kevent(poller_, &change, 1, nullptr, 0, nullptr);
+#endif
+    }
+
+    //remove() for whatever descriptor routine waits on, it is destroyed
+    inline void forget(Routine *routine) {
+        for (size_t fd = 0; fd < interests_.size(); ++fd) {
+            remove(routine, int(fd), false);
+            remove(routine, int(fd), true);
+        }
+    }
+
+    //wait up to timeout milliseconds (-1 for ever) and return the routines
+    //whose descriptors became ready, chained through next
+    inline Routine *poll(int timeout) {
+        Routine *ready = nullptr;
+#ifdef COROUTINE_REACTOR_EPOLL
+        epoll_event events[kEvents];
+        int count = epoll_wait(poller_, events, kEvents, timeout);
+        for (int i = 0; i < count; ++i) {
+            int fd = events[i].data.fd;
+            if (fd == wakeup_) {
+                uint64_t value;
+                ssize_t n = ::read(wakeup_, &value, sizeof(value));
+                (void)n;
+                continue;
+            }
+            Interest& interest = interests_[size_t(fd)];
+            uint32_t flags = events[i].events;
+            if (flags & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR)) {
+                take(interest.reader, ready);
+            }
+            if (flags & (EPOLLOUT | EPOLLHUP | EPOLLERR)) {
+                take(interest.writer, ready);
+            }
+            //one-shot disarmed the other direction as well
+            if (interest.reader != nullptr || interest.writer != nullptr) {
+                arm(fd, interest);
+            }
+        }
+#else
+        struct kevent events[kEvents];
+        struct timespec ts;
+        ts.tv_sec = timeout / 1000;
+        ts.tv_nsec = long(timeout % 1000) * 1000000;
+        int count = kevent(poller_, nullptr, 0, events, kEvents, timeout < 0 ? nullptr : &ts);
+        for (int i = 0; i < count; ++i) {
+            if (events[i].filter == EVFILT_USER) {
+                continue;
+            }
+            Interest& interest = interests_[size_t(events[i].ident)];
+            take(events[i].filter == EVFILT_WRITE ? interest.writer : interest.reader, ready);
+        }
+#endif
+        return ready;
+    }
+
+    //make a poll() blocked on another thread return
+    inline void interrupt() {
+#ifdef COROUTINE_REACTOR_EPOLL
+        uint64_t value = 1;
+        ssize_t n = ::write(wakeup_, &value, sizeof(value));
+        (void)n;
+#else
+        struct kevent change;
+        EV_SET(&change, 0, EVFILT_USER, 0, NOTE_TRIGGER, 0, nullptr);
+        kevent(poller_, &change, 1, nullptr, 0, nullptr);
+#endif
+    }
+
+    //routines armed and not handed back yet
+    inline size_t waiting() const {
+        return waiting_;
+    }
+
+private:
+    struct Interest {
+        Routine *reader;
+        Routine *writer;
+    };
+
+    static constexpr int kEvents = 128;
+
+#ifdef COROUTINE_REACTOR_EPOLL
+    inline int arm(int fd, const Interest& interest) {
+        epoll_event event = {};
+        event.events = EPOLLONESHOT;
+        if (interest.reader != nullptr) {
+            event.events |= EPOLLIN | EPOLLRDHUP;
+        }
+        if (interest.writer != nullptr) {
+            event.events |= EPOLLOUT;
+        }
+        event.data.fd = fd;
+        if (epoll_ctl(poller_, EPOLL_CTL_MOD, fd, &event) == 0) {
+            return 0;
+        }
+        if (errno != ENOENT) {
+            return -1;
+        }
+        return epoll_ctl(poller_, EPOLL_CTL_ADD, fd, &event);
+    }
+#endif
+
+    inline void take(Routine *& slot, Routine *& ready) {
+        Routine *routine = slot;
+        if (routine == nullptr) {
+            return;
+        }
+        slot = nullptr;
+        --waiting_;
+        routine->next = ready;
+        ready = routine;
+    }
+
+    int poller_;
+#ifdef COROUTINE_REACTOR_EPOLL
+    int wakeup_;
+#endif
+    std::vector<Interest> interests_;
+    size_t waiting_;
+};
+
+#endif
+
+struct ReadyQueue {
+    Routine *head;
+    Routine *tail;
+    //turns given to higher classes while this one had routines queued
+    size_t skipped;
+
+    ReadyQueue()
+        : head(nullptr)
+        , tail(nullptr)
+        , skipped(0) {
+    }
+};
+
+//the fields other threads write, the mailbox and its lock, have cache lines
+//of their own, away from running and the ready queues this thread switches on
+struct Ordinator {
+    RoutineArena arena;
+    std::vector<Slot> slots;
+    uint32_t free_slot;
+    Routine *running;
+    //routines woken on this thread, one FIFO per Priority, run by
+    //run()/run_until_idle()
+    ReadyQueue ready[kPriorityCount];
+    size_t ready_count;
+    //routines readied by other threads, pushed newest first without a lock
+    //and moved to the ready queue by this one a whole batch at a time. Holds
+    //mailbox_asleep() while this thread sleeps in run(), only the waker that
+    //replaces the mark takes remote_mutex and wakes it.
+    alignas(kCacheLine) std::atomic<Routine *> mailbox;
+    std::mutex remote_mutex;
+    std::condition_variable remote_cv;
+    //routines of this thread in waits another thread may end (await() calls,
+    //channels), run() waits for them
+    alignas(kCacheLine) size_t pending;
+    //timed waits of this thread's routines
+    TimerHeap timers;
+#ifdef COROUTINE_REACTOR
+    //created by the first routine that waits for a descriptor
+    std::unique_ptr<Reactor> reactor;
+    //run() sleeps in reactor->poll(), guarded by remote_mutex
+    bool polling;
+#endif
+    //set by a routine before it switches out, decides on the main context
+    //whether it really suspends, see switch_in()
+    bool (*suspend)(void *);
+    void *suspend_arg;
+    //rotates the first case select() tries
+    size_t select_turn;
+    //RoutineLocal values of the main context
+    LocalSlots locals;
+#if COROUTINE_STATS
+    ThreadStats stats;
+#endif
+#if COROUTINE_PROFILE
+    Slice slice;
+#endif
+    //set while this thread is a worker of scheduler
+    Scheduler *scheduler;
+    size_t worker;
+    size_t stack_size;
+    StackPool stack_pool;
+    Stack shared_stack;
+    Routine *shared_owner;
+    Context ctx;
+
+    inline Ordinator(size_t ss = STACK_LIMIT)
+        : free_slot(0)
+        , running(nullptr)
+        , ready_count(0)
+        , mailbox(nullptr)
+        , pending(0)
+#ifdef COROUTINE_REACTOR
+        , polling(false)
+#endif
+        , suspend(nullptr)
+        , suspend_arg(nullptr)
+        , select_turn(0)
+        , scheduler(nullptr)
+        , worker(0)
+        , stack_size(ss)
+        , shared_stack()
+        , shared_owner(nullptr)
+        , ctx() {
+#if COROUTINE_BACKEND == COROUTINE_BACKEND_FIBER
+        ctx.fiber = ConvertThreadToFiber(nullptr);
+#endif
+#if COROUTINE_STATS
+        {
+            StatsRegistry& registry = stats_registry();
+            std::lock_guard<std::mutex> lock(registry.mutex);
+            registry.threads.push_back(&stats);
+        }
+#endif
+#if COROUTINE_PROFILE
+        {
+            SliceRegistry& registry = slice_registry();
+            std::lock_guard<std::mutex> lock(registry.mutex);
+            registry.slices.push_back(&slice);
+        }
+#endif
+    }
+
+    ~Ordinator() {
+#if COROUTINE_STATS
+        {
+            StatsRegistry& registry = stats_registry();
+            std::lock_guard<std::mutex> lock(registry.mutex);
+            registry.threads.erase(std::find(registry.threads.begin(), registry.threads.end(), &stats));
+            ThreadStats& retired = registry.retired;
+            stat_add(retired.live, stats.live.load(std::memory_order_relaxed));
+            stat_add(retired.runnable, stats.runnable.load(std::memory_order_relaxed));
+            stat_add(retired.waiting, stats.waiting.load(std::memory_order_relaxed));
+            stat_add(retired.finished, stats.finished.load(std::memory_order_relaxed));
+            stat_add(retired.switches, stats.switches.load(std::memory_order_relaxed));
+            stat_max(retired.stack_peak, stats.stack_peak.load(std::memory_order_relaxed));
+            stat_max(retired.channel_high_water, stats.channel_high_water.load(std::memory_order_relaxed));
+        }
+#endif
+#if COROUTINE_PROFILE
+        {
+            SliceRegistry& registry = slice_registry();
+            std::lock_guard<std::mutex> lock(registry.mutex);
+            registry.slices.erase(std::find(registry.slices.begin(), registry.slices.end(), &slice));
+        }
+#endif
+        for (Slot& slot : slots) {
+            Routine *routine = slot.routine;
+            if (routine != nullptr) {
+                if (!routine->shared) {
+                    stack_free(routine->stack);
+                }
+                routine->~Routine();
+            }
+        }
+        stack_free(shared_stack);
+    }
+};
+
+//one Ordinator per thread, shared by every translation unit. Kept out of
+//line on purpose: a scheduled routine may continue on another thread after a
+//switch, and an inlined thread_local address could be reused from before it.
+COROUTINE_NOINLINE inline Ordinator& this_ordinator() {
+    thread_local Ordinator ordinator;
+#ifndef _MSC_VER
+    __asm__ __volatile__("");
+#endif
+    return ordinator;
+}
+
+inline Routine *lookup(Ordinator& ordinator, routine_t id) {
+    uint32_t index = uint32_t(id) - 1;
+    if (index >= ordinator.slots.size()) {
+        return nullptr;
+    }
+    const Slot& slot = ordinator.slots[index];
+    if (slot.generation != uint32_t(id >> 32)) {
+        return nullptr;
+    }
+    return slot.routine;
+}
+
+inline void enqueue(Ordinator& ordinator, Routine *routine) {
+    assert(!routine->queued);
+    COROUTINE_COUNT(ordinator, runnable, 1);
+    ReadyQueue& queue = ordinator.ready[size_t(routine->priority)];
+    routine->queued = true;
+    routine->next = nullptr;
+    routine->prev = queue.tail;
+    if (queue.tail != nullptr) {
+        queue.tail->next = routine;
+    } else {
+        queue.head = routine;
+    }
+    queue.tail = routine;
+    ++ordinator.ready_count;
+}
+
+inline void unlink(Ordinator& ordinator, Routine *routine) {
+    assert(routine->queued);
+    COROUTINE_COUNT(ordinator, runnable, -1);
+    ReadyQueue& queue = ordinator.ready[size_t(routine->priority)];
+    if (routine->prev != nullptr) {
+        routine->prev->next = routine->next;
+    } else {
+        queue.head = routine->next;
+    }
+    if (routine->next != nullptr) {
+        routine->next->prev = routine->prev;
+    } else {
+        queue.tail = routine->prev;
+    }
+    routine->next = nullptr;
+    routine->prev = nullptr;
+    routine->queued = false;
+    --ordinator.ready_count;
+}
+
+//take the next routine to run: the first of the highest class, unless a
+//lower class has been passed over kPriorityBurst times, so low work still
+//gets a share under load
+inline Routine *pick_ready(Ordinator& ordinator) {
+    ReadyQueue *queues = ordinator.ready;
+    //everything at normal priority, the usual case, is a plain FIFO
+    ReadyQueue& normal = queues[size_t(Priority::normal)];
+    if (queues[size_t(Priority::high)].head == nullptr && queues[size_t(Priority::low)].head == nullptr) {
+        Routine *routine = normal.head;
+        if (routine != nullptr) {
+            normal.skipped = 0;
+            unlink(ordinator, routine);
+        }
+        return routine;
+    }
+    size_t chosen = kPriorityCount;
+    for (size_t i = 0; i < kPriorityCount; ++i) {
+        if (queues[i].head == nullptr) {
+            continue;
+        }
+        if (chosen == kPriorityCount) {
+            chosen = i;
+        } else if (queues[i].skipped >= kPriorityBurst) {
+            chosen = i;
+            break;
+        }
+    }
+    if (chosen == kPriorityCount) {
+        return nullptr;
+    }
+    for (size_t i = chosen + 1; i < kPriorityCount; ++i) {
+        if (queues[i].head != nullptr) {
+            ++queues[i].skipped;
+        }
+    }
+    queues[chosen].skipped = 0;
+    Routine *routine = queues[chosen].head;
+    unlink(ordinator, routine);
+    return routine;
+}
+
+//never a routine, marks the mailbox of a thread that sleeps in run()
+inline Routine *mailbox_asleep() {
+    return reinterpret_cast<Routine *>(uintptr_t(1));
+}
+
+//move the routines other threads handed back onto the ready queue
+inline void drain_remote(Ordinator& ordinator) {
+    if (ordinator.mailbox.load(std::memory_order_relaxed) == nullptr) {
+        return;
+    }
+
+    Routine *routine = ordinator.mailbox.exchange(nullptr, std::memory_order_acquire);
+    assert(routine != mailbox_asleep());
+    //pushed newest first, queue them oldest first
+    Routine *oldest = nullptr;
+    while (routine != nullptr) {
+        Routine *next = routine->next;
+        routine->next = oldest;
+        oldest = routine;
+        routine = next;
+    }
+    while (oldest != nullptr) {
+        Routine *next = oldest->next;
+        oldest->waiting = false;
+        enqueue(ordinator, oldest);
+        oldest = next;
+    }
+}
+
+//put the mailbox_asleep() mark in an empty mailbox, with remote_mutex held;
+//false if something arrived meanwhile
+inline bool mailbox_sleep(Ordinator& ordinator) {
+    Routine *empty = nullptr;
+    return ordinator.mailbox.compare_exchange_strong(empty, mailbox_asleep(), std::memory_order_relaxed);
+}
+
+//take the mark back when woken by something else, with remote_mutex held
+inline void mailbox_wake(Ordinator& ordinator) {
+    Routine *mark = mailbox_asleep();
+    ordinator.mailbox.compare_exchange_strong(mark, nullptr, std::memory_order_relaxed);
+}
+
+//wait_state is epoch << 7 | shielded << 6 | cancel pending << 5 | cancelled << 4
+//| timed out << 3 | park << 2 | phase. A routine arms a wait with begin_wait(),
+//registers with whatever may end it and suspends in suspend_wait(). Wakers
+//holding the epoch race in claim(), exactly one wins, the others and any
+//stale waker of an older wait fail.
+enum : uint64_t {
+    kWaitIdle = 0,
+    //armed, the routine may still be on its own stack
+    kWaitArmed = 1,
+    //off its stack, the claimer hands it back
+    kWaitSuspended = 2,
+    //claimed before it got off its stack, it simply runs on
+    kWaitClaimed = 3,
+    kWaitPhase = 3,
+    //a park(), that wake() may end
+    kWaitPark = 4,
+    //ended by its deadline
+    kWaitTimedOut = 8,
+    //ended by cancel()
+    kWaitCancelled = 16,
+    //cancel() was called and not delivered yet, kept across waits
+    kWaitCancelPending = 32,
+    //a wait cancel() must leave alone (offload())
+    kWaitShielded = 64,
+    kWaitEpochShift = 7
+};
+
+//kind is 0, kWaitPark or kWaitShielded. A routine with a cancel pending
+//finds its wait claimed as cancelled at once, it runs on past suspend_wait().
+inline uint64_t begin_wait(Routine *routine, uint64_t kind = 0) {
+    uint64_t state = routine->wait_state.load(std::memory_order_relaxed);
+    for (;;) {
+        const uint64_t epoch = (state >> kWaitEpochShift) + 1;
+        const uint64_t pending = state & kWaitCancelPending;
+        uint64_t next = epoch << kWaitEpochShift | pending | kind;
+        next |= pending != 0 && (kind & kWaitShielded) == 0 ? uint64_t(kWaitCancelled | kWaitClaimed)
+                                                             : uint64_t(kWaitArmed);
+        //a cancel() from another thread may set the pending bit meanwhile
+        if (routine->wait_state.compare_exchange_weak(state, next, std::memory_order_acq_rel,
+                                                      std::memory_order_relaxed)) {
+            return epoch;
+        }
+    }
+}
+
+//called on the main context right after the routine switched out of its wait
+inline bool settle_wait(void *arg) {
+    Routine *routine = static_cast<Routine *>(arg);
+    uint64_t state = routine->wait_state.load(std::memory_order_acquire);
+    if ((state & kWaitPhase) == kWaitArmed
+        && routine->wait_state.compare_exchange_strong(state, (state & ~kWaitPhase) | kWaitSuspended,
+                                                       std::memory_order_acq_rel,
+                                                       std::memory_order_acquire)) {
+        COROUTINE_COUNT(this_ordinator(), waiting, 1);
+        return true;
+    }
+    assert((state & kWaitPhase) == kWaitClaimed);
+    //not a store, a cancel() may be setting its bit meanwhile
+    routine->wait_state.fetch_and(~uint64_t(kWaitPhase), std::memory_order_relaxed);
+    return false;
+}
+
+//whether the last wait of the routine ended by its deadline
+inline bool timed_out(const Routine *routine) {
+    return (routine->wait_state.load(std::memory_order_acquire) & kWaitTimedOut) != 0;
+}
+
+//whether the last wait of the routine ended by cancel()
+inline bool wait_cancelled(const Routine *routine) {
+    return (routine->wait_state.load(std::memory_order_acquire) & kWaitCancelled) != 0;
+}
+
+//thrown at the suspension point where a cancelled routine notices it; its
+//frames unwind and it finishes like it returned, see cancel()
+class Cancelled : public std::system_error {
+public:
+    Cancelled()
+        : std::system_error(std::make_error_code(std::errc::operation_canceled), "cancelled") {
+    }
+};
+
+//error of a future whose routine was cancelled. Not a Cancelled, so get()
+//throwing it does not unwind the joiner as if it was cancelled itself.
+class FutureCancelled : public std::system_error {
+public:
+    FutureCancelled()
+        : std::system_error(std::make_error_code(std::errc::operation_canceled), "future cancelled") {
+    }
+};
+
+//deliver the cancel, the routine's later waits are ordinary again. Only
+//called once the wait that was cancelled is undone.
+inline void throw_cancelled(Routine *routine) {
+    routine->wait_state.fetch_and(~uint64_t(kWaitCancelPending | kWaitCancelled), std::memory_order_relaxed);
+    throw Cancelled();
+}
+
+inline void check_cancelled(Routine *routine) {
+    if (routine != nullptr && wait_cancelled(routine)) {
+        throw_cancelled(routine);
+    }
+}
+
+inline bool is_parked(const Routine *routine) {
+    uint64_t state = routine->wait_state.load(std::memory_order_acquire);
+    return (state & kWaitPark) != 0 && (state & kWaitPhase) == kWaitSuspended;
+}
+
+//end the wait epoch of routine and hand it back if it already switched out,
+//false if another waker was first or the wait is over
+inline bool claim(Routine *routine, uint64_t epoch, bool timeout = false);
+
+//get a routine destroy() frees out of the wait it is in, see below
+inline void leave_wait(Ordinator& ordinator, Routine *routine);
+
+#ifdef COROUTINE_REACTOR
+
+//hand back the routines whose descriptors are ready, waits up to timeout
+//ms; a claim fails for one that cancel() got to first
+inline void poll_io(Ordinator& ordinator, int timeout) {
+    Routine *routine = ordinator.reactor->poll(timeout);
+    while (routine != nullptr) {
+        Routine *next = routine->next;
+        claim(routine, routine->wait_state.load(std::memory_order_acquire) >> kWaitEpochShift);
+        routine = next;
+    }
+}
+
+inline size_t io_waiting(const Ordinator& ordinator) {
+    return ordinator.reactor ? ordinator.reactor->waiting() : 0;
+}
+
+#endif
+
+//claim the waits whose deadline passed
+inline void fire_timers(Ordinator& ordinator) {
+    TimerHeap& timers = ordinator.timers;
+    if (timers.empty()) {
+        return;
+    }
+    const std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+    while (!timers.empty() && timers.top()->deadline <= now) {
+        Routine *routine = timers.top();
+        timers.remove(routine);
+        claim(routine, routine->timer_epoch, true);
+    }
+}
+
+//milliseconds until deadline rounded up, for the reactor
+inline int poll_timeout(std::chrono::steady_clock::time_point deadline) {
+    auto left = deadline - std::chrono::steady_clock::now();
+    if (left <= left.zero()) {
+        return 0;
+    }
+    auto ms = std::chrono::duration_cast<std::chrono::milliseconds>(left).count() + 1;
+    return ms > INT32_MAX ? INT32_MAX : int(ms);
+}
+
+inline bool has_stack(Routine *routine) {
+#ifdef _MSC_VER
+    return routine->stack.fiber != nullptr;
+#else
+    return routine->stack.base != nullptr;
+#endif
+}
+
+//fold what the routine used of its stack into its tag and the stats
+inline void stack_sample(Ordinator& ordinator, Routine *routine) {
+#if COROUTINE_STACK_PAINT && !defined(_MSC_VER)
+    if (!routine->shared) {
+        Stack& stack = routine->stack;
+        size_t used = stack_scan(stack);
+        routine->stack_peak = std::max(routine->stack_peak, used);
+        stats_stack_touched(stack, stack_round(used));
+        //paint it again for whoever gets it from the pool
+        std::memset(stack.base + stack.size - used, 0, used);
+    }
+#endif
+#if COROUTINE_STATS
+    stat_max(ordinator.stats.stack_peak, int64_t(routine->stack_peak));
+#else
+    (void)ordinator;
+#endif
+    if (routine->tag != nullptr) {
+        stack_record(routine->tag, routine->stack_peak);
+    }
+}
+
+inline void release_stack(Ordinator& ordinator, Routine *routine) {
+    if (!has_stack(routine)) {
+        return;
+    }
+    stack_sample(ordinator, routine);
+
+    if (routine->shared) {
+        if (ordinator.shared_owner == routine) {
+            ordinator.shared_owner = nullptr;
+        }
+        routine->save_buffer.reset();
+        routine->save_size = 0;
+        routine->save_capacity = 0;
+        routine->stack = Stack();
+        return;
+    }
+
+#ifdef _MSC_VER
+    //a fiber destroyed half way through its function can not be reused
+    if (!routine->finished) {
+        stack_free(routine->stack);
+        return;
+    }
+#endif
+    //a scheduled routine that ended on another NUMA node than it started on
+    //gives its stack back to the system, not to this node's pool
+    if (routine->scheduler != nullptr && routine->stack_node != current_node()) {
+        stack_free(routine->stack);
+        return;
+    }
+    ordinator.stack_pool.release(routine->stack);
+    routine->stack = Stack();
+}
+
+template<typename Function>
+routine_t create(Function&& func, const RoutineOptions& options) {
+    Ordinator& ordinator = this_ordinator();
+    void *block = ordinator.arena.allocate();
+    Routine *routine = new (block) Routine(options);
+    try {
+        routine->bind(std::forward<Function>(func));
+    } catch (...) {
+        routine->~Routine();
+        ordinator.arena.release(block);
+        throw;
+    }
+    routine->home = &ordinator;
+    COROUTINE_COUNT(ordinator, live, 1);
+
+    if (routine->stack_size == 0) {
+        routine->stack_size = adaptive_stack_size(routine->tag, ordinator.stack_size);
+    }
+
+    uint32_t index;
+    if (ordinator.free_slot == 0) {
+        index = uint32_t(ordinator.slots.size());
+        ordinator.slots.push_back(Slot{ nullptr, 0, 0 });
+    } else {
+        index = ordinator.free_slot - 1;
+        ordinator.free_slot = ordinator.slots[index].next_free;
+    }
+
+    Slot& slot = ordinator.slots[index];
+    assert(slot.routine == nullptr);
+    slot.routine = routine;
+    routine->id = routine_t(slot.generation) << 32 | (index + 1);
+    return routine->id;
+}
+
+template<typename Function>
+routine_t create(Function&& func) {
+    return create(std::forward<Function>(func), RoutineOptions());
+}
+
+//create a routine that the run loop starts, and destroys once it finishes
+template<typename Function>
+routine_t spawn(Function&& func, const RoutineOptions& options) {
+    Ordinator& ordinator = this_ordinator();
+    routine_t id = create(std::forward<Function>(func), options);
+    Routine *routine = lookup(ordinator, id);
+    routine->detached = true;
+    enqueue(ordinator, routine);
+    return id;
+}
+
+template<typename Function>
+routine_t spawn(Function&& func) {
+    return spawn(std::forward<Function>(func), RoutineOptions());
+}
+
+inline void destroy(Ordinator& ordinator, Routine *routine) {
+    assert(routine != ordinator.running);
+    //no waker may hand it back once it is freed
+    leave_wait(ordinator, routine);
+    COROUTINE_COUNT(ordinator, live, -1);
+    COROUTINE_COUNT(ordinator, finished, routine->finished ? -1 : 0);
+    ordinator.timers.remove(routine);
+    routine_t id = routine->id;
+
+    if (routine->queued) {
+        unlink(ordinator, routine);
+    }
+    release_stack(ordinator, routine);
+    routine->~Routine();
+    ordinator.arena.release(routine);
+
+    uint32_t index = uint32_t(id) - 1;
+    Slot& slot = ordinator.slots[index];
+    slot.routine = nullptr;
+    ++slot.generation;
+    slot.next_free = ordinator.free_slot;
+    ordinator.free_slot = index + 1;
+}
+
+//stale or unknown handles are ignored
+inline void destroy(routine_t id) {
+    Ordinator& ordinator = this_ordinator();
+    Routine *routine = lookup(ordinator, id);
+    if (routine != nullptr) {
+        drain_remote(ordinator);
+        destroy(ordinator, routine);
+    }
+}
+
+#if COROUTINE_BACKEND == COROUTINE_BACKEND_FIBER
+
+//pooled fibers never return, each pass of the loop runs one routine
+inline void __stdcall entry(LPVOID lpParameter) {
+    for (;;) {
+        Routine *routine = this_ordinator().running;
+        assert(routine != nullptr);
+
+        try {
+            routine->invoke(routine);
+        } catch (const Cancelled&) {
+            //unwound by cancel(), it finishes like it returned
+        }
+
+        //the routine may have been moved to another thread meanwhile
+        Ordinator& ordinator = this_ordinator();
+        Routine *puller = routine->puller;
+        routine->finished = true;
+        ordinator.running = puller;
+        context_switch(routine->ctx, puller != nullptr ? puller->ctx : ordinator.ctx);
+    }
+}
+
+#else
+
+//never returns, the finished routine switches back for good and keeps its
+//slot until destroy()
+inline void entry() {
+    Routine *routine = this_ordinator().running;
+    try {
+        routine->invoke(routine);
+    } catch (const Cancelled&) {
+        //unwound by cancel(), it finishes like it returned
+    }
+
+    //the routine may have been moved to another thread meanwhile
+    Ordinator& ordinator = this_ordinator();
+    Routine *puller = routine->puller;
+    routine->finished = true;
+    ordinator.running = puller;
+    context_switch(routine->ctx, puller != nullptr ? puller->ctx : ordinator.ctx);
+}
+
+#endif
+
+#if COROUTINE_BACKEND != COROUTINE_BACKEND_FIBER
+
+//lowest byte of the suspended routine's frames on the shared stack
+inline char *suspended_stack_pointer(Routine *routine) {
+#if COROUTINE_BACKEND == COROUTINE_BACKEND_ASM
+    return static_cast<char *>(routine->ctx.sp);
+#else
+    //swapcontext keeps registers in the ucontext, leave room for its frame
+    const size_t slack = 256;
+    char *sp = routine->stack_sp - slack;
+    return sp < routine->stack.base ? routine->stack.base : sp;
+#endif
+}
+
+inline void save_shared_stack(Routine *routine) {
+    char *stack_top = routine->stack.base + routine->stack.size;
+    char *sp = suspended_stack_pointer(routine);
+    size_t size = size_t(stack_top - sp);
+
+    if (routine->save_capacity < size) {
+        routine->save_buffer.reset(new char[size]);
+        routine->save_capacity = size;
+    }
+    std::memcpy(routine->save_buffer.get(), sp, size);
+    routine->save_size = size;
+}
+
+inline void restore_shared_stack(Routine *routine) {
+    char *stack_top = routine->stack.base + routine->stack.size;
+    std::memcpy(stack_top - routine->save_size, routine->save_buffer.get(), routine->save_size);
+}
+
+//copy the current owner off the shared stack and put routine back on it,
+//nothing is copied when the same routine is resumed again
+inline void acquire_shared_stack(Ordinator& ordinator, Routine *routine) {
+    if (ordinator.shared_stack.base == nullptr) {
+        ordinator.shared_stack = stack_allocate(SHARED_STACK_LIMIT);
+    }
+
+    Routine *owner = ordinator.shared_owner;
+    if (owner == routine) {
+        return;
+    }
+    if (owner != nullptr) {
+        save_shared_stack(owner);
+    }
+
+    if (routine->stack.base == nullptr) {
+        routine->stack = ordinator.shared_stack;
+        context_make(routine->ctx, routine->stack, entry);
+    } else {
+        restore_shared_stack(routine);
+    }
+    ordinator.shared_owner = routine;
+}
+
+#endif
+
+//give a routine its own stack from the pool the first time it runs
+inline void take_stack(Ordinator& ordinator, Routine *routine) {
+    routine->stack = ordinator.stack_pool.acquire(routine->stack_size);
+    if (routine->scheduler != nullptr) {
+        routine->stack_node = current_node();
+    }
+#if COROUTINE_BACKEND == COROUTINE_BACKEND_FIBER
+    routine->ctx.fiber = routine->stack.fiber;
+#else
+    context_make(routine->ctx, routine->stack, entry);
+#endif
+}
+
+//run routine until it yields or finishes, called from the thread's main context.
+//Returns true when the routine suspended through ordinator.suspend, another
+//thread may own it from then on and the caller must not touch it again.
+inline bool switch_in(Ordinator& ordinator, Routine *routine) {
+    if (routine->shared) {
+#if COROUTINE_BACKEND != COROUTINE_BACKEND_FIBER
+        acquire_shared_stack(ordinator, routine);
+#endif
+    } else if (!has_stack(routine)) {
+        take_stack(ordinator, routine);
+    }
+
+    ordinator.running = routine;
+    COROUTINE_COUNT(ordinator, switches, 1);
+#if COROUTINE_PROFILE
+    Slice& slice = ordinator.slice;
+    slice.serial.store(slice.serial.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+    slice.id.store(routine->id, std::memory_order_relaxed);
+    slice.tag.store(routine->tag, std::memory_order_relaxed);
+    const uint64_t start = cpu_ticks();
+    slice.start.store(start, std::memory_order_release);
+#endif
+    context_switch(ordinator.ctx, routine->ctx);
+#if COROUTINE_PROFILE
+    //still ours: whoever it waits for is only told below
+    slice.start.store(0, std::memory_order_relaxed);
+    routine->cpu_ticks += cpu_ticks() - start;
+#endif
+
+    //the stack is no longer needed once the routine has run to completion
+    if (routine->finished) {
+        COROUTINE_COUNT(ordinator, finished, routine->scheduler == nullptr ? 1 : 0);
+        release_stack(ordinator, routine);
+        return false;
+    }
+
+    //the routine is off its stack now, so whoever it waits for may be told
+    //to hand it back; false means that already happened meanwhile
+    bool (*check)(void *) = ordinator.suspend;
+    if (check == nullptr) {
+        return false;
+    }
+    ordinator.suspend = nullptr;
+    const bool local = routine->scheduler == nullptr;
+    if (local) {
+        routine->waiting = true;
+    }
+    if (!check(ordinator.suspend_arg)) {
+        if (local) {
+            routine->waiting = false;
+        }
+        return false;
+    }
+    return true;
+}
+
+inline int resume(routine_t id) {
+    Ordinator& ordinator = this_ordinator();
+    assert(ordinator.running == nullptr);
+
+    Routine *routine = lookup(ordinator, id);
+    if (routine == nullptr) {
+        return -1;
+    }
+
+    if (routine->finished) {
+        return -2;
+    }
+
+    //a parked routine may be resumed by hand, any other wait hands the
+    //routine to the ready queue by itself once it is over
+    drain_remote(ordinator);
+    if (routine->waiting) {
+        uint64_t state = routine->wait_state.load(std::memory_order_acquire);
+        if (!is_parked(routine) || !claim(routine, state >> kWaitEpochShift)) {
+            return 0;
+        }
+    }
+
+    //resumed by hand while woken, the run loop must not resume it again
+    if (routine->queued) {
+        unlink(ordinator, routine);
+    }
+    switch_in(ordinator, routine);
+    return 0;
+}
+
+//record how deep the running routine is into its stack before it switches
+//out, sp is a local of the caller
+inline void probe_stack(Ordinator& ordinator, Routine *routine, char *sp) {
+#ifndef _MSC_VER
+    char *stack_top = routine->stack.base + routine->stack.size;
+    const size_t depth = size_t(stack_top - sp);
+    assert(depth <= routine->stack.size);
+    routine->stack_sp = sp;
+    if (depth > routine->stack_peak) {
+        routine->stack_peak = depth;
+    }
+#if COROUTINE_STATS
+    stats_stack_touched(routine->shared ? ordinator.shared_stack : routine->stack, stack_round(depth));
+#else
+    (void) ordinator;
+#endif
+#else
+    (void) ordinator;
+    (void) routine;
+    (void) sp;
+#endif
+}
+
+//nothing may touch the Ordinator after the switch, the routine can be
+//resumed by another thread's Ordinator
+inline void yield() {
+    Ordinator& ordinator = this_ordinator();
+    Routine *routine = ordinator.running;
+    assert(routine != nullptr);
+    //a generator pulled by a routine may only switch out in Yield
+    assert(routine->puller == nullptr);
+
+    char stack_bottom = 0;
+    probe_stack(ordinator, routine, &stack_bottom);
+    ordinator.running = nullptr;
+    context_switch(routine->ctx, ordinator.ctx);
+}
+
+//switch out and call check(arg) from the main context, the routine stays
+//suspended if it returns true and runs on when it returns false
+inline void suspend(bool (*check)(void *), void *arg) {
+    Ordinator& ordinator = this_ordinator();
+    assert(ordinator.running != nullptr);
+    ordinator.suspend = check;
+    ordinator.suspend_arg = arg;
+    yield();
+}
+
+//suspend until the wait begun by begin_wait() is claimed
+inline void suspend_wait(Routine *routine) {
+    suspend(&settle_wait, routine);
+}
+
+//suspend the current routine until someone calls wake() on it, unlike
+//yield() the run loop does not queue it again by itself
+inline void park() {
+    Ordinator& ordinator = this_ordinator();
+    Routine *routine = ordinator.running;
+    assert(routine != nullptr);
+    begin_wait(routine, kWaitPark);
+    suspend_wait(routine);
+    check_cancelled(routine);
+}
+
+//run a generator's routine to its next value or to its end. From the main
+//context this is resume(); from a routine it switches straight over and the
+//generator switches straight back, its time counts to the routine pulling it.
+inline void pull(Routine *routine) {
+    Ordinator& ordinator = this_ordinator();
+    Routine *puller = ordinator.running;
+    assert(puller == nullptr || puller->scheduler == nullptr);
+    routine->puller = puller;
+    if (puller == nullptr) {
+        switch_in(ordinator, routine);
+        return;
+    }
+
+    if (!has_stack(routine)) {
+        take_stack(ordinator, routine);
+    }
+    char stack_bottom = 0;
+    probe_stack(ordinator, puller, &stack_bottom);
+    ordinator.running = routine;
+    COROUTINE_COUNT(ordinator, switches, 1);
+    context_switch(puller->ctx, routine->ctx);
+
+    if (routine->finished) {
+        COROUTINE_COUNT(ordinator, finished, 1);
+        release_stack(ordinator, routine);
+    }
+}
+
+//switch a generator back to whoever pulled it
+inline void unpull(Routine *routine) {
+    Ordinator& ordinator = this_ordinator();
+    Routine *puller = routine->puller;
+    char stack_bottom = 0;
+    probe_stack(ordinator, routine, &stack_bottom);
+    ordinator.running = puller;
+    context_switch(routine->ctx, puller != nullptr ? puller->ctx : ordinator.ctx);
+}
+
+//run the routines that are ready right now and those they wake, in batches
+//so routines woken during a pass wait for the next one, returns how many
+//switches were made
+inline size_t run_until_idle() {
+    Ordinator& ordinator = this_ordinator();
+    assert(ordinator.running == nullptr);
+
+    size_t switches = 0;
+    for (;;) {
+        drain_remote(ordinator);
+        fire_timers(ordinator);
+#ifdef COROUTINE_REACTOR
+        if (io_waiting(ordinator) != 0) {
+            poll_io(ordinator, 0);
+        }
+#endif
+        //a pass runs as many routines as were queued when it began, then
+        //timers and descriptors are looked at again
+        size_t budget = ordinator.ready_count;
+        if (budget == 0) {
+            break;
+        }
+
+        while (Routine *routine = pick_ready(ordinator)) {
+
+            const bool suspended = switch_in(ordinator, routine);
+            ++switches;
+
+            if (routine->finished) {
+                if (routine->detached) {
+                    destroy(ordinator, routine);
+                }
+            } else if (!suspended && !routine->waiting && !routine->queued) {
+                //yielded, still runnable
+                enqueue(ordinator, routine);
+            }
+            if (--budget == 0) {
+                break;
+            }
+            //routines woken by other threads may outrank what is queued
+            drain_remote(ordinator);
+        }
+    }
+    return switches;
+}
+
+//event loop of the thread, returns once nothing is left that could run,
+//sleeps while routines only wait for await() calls, descriptors or timers
+//run() that also returns as soon as done() holds after a pass, true then.
+//done() is read with remote_mutex held, a waker on another thread sets what
+//it reads under that lock and notifies remote_cv. With linger it does not
+//return when nothing is left to run here, only done() or deadline end it.
+template<typename Done>
+bool drive(Ordinator& ordinator, Done done,
+           std::chrono::steady_clock::time_point deadline = std::chrono::steady_clock::time_point::max(),
+           bool linger = false) {
+    const bool timed = deadline != std::chrono::steady_clock::time_point::max();
+    for (;;) {
+        run_until_idle();
+        std::unique_lock<std::mutex> lock(ordinator.remote_mutex);
+        if (done()) {
+            return true;
+        }
+        if (timed && std::chrono::steady_clock::now() >= deadline) {
+            return false;
+        }
+        const TimerHeap& timers = ordinator.timers;
+        const std::chrono::steady_clock::time_point wake = timers.empty() ? deadline
+                                                          : std::min(timers.top()->deadline, deadline);
+#ifdef COROUTINE_REACTOR
+        if (io_waiting(ordinator) != 0) {
+            if (!mailbox_sleep(ordinator)) {
+                continue;
+            }
+            ordinator.polling = true;
+            lock.unlock();
+            poll_io(ordinator, wake == std::chrono::steady_clock::time_point::max() ? -1 : poll_timeout(wake));
+            lock.lock();
+            ordinator.polling = false;
+            mailbox_wake(ordinator);
+            continue;
+        }
+#endif
+        if (!linger && ordinator.pending == 0 && timers.empty()) {
+            return false;
+        }
+        if (!mailbox_sleep(ordinator)) {
+            continue;
+        }
+        auto ready = [&ordinator, &done] {
+            return ordinator.mailbox.load(std::memory_order_relaxed) != mailbox_asleep() || done();
+        };
+        if (wake == std::chrono::steady_clock::time_point::max()) {
+            ordinator.remote_cv.wait(lock, ready);
+        } else {
+            ordinator.remote_cv.wait_until(lock, wake, ready);
+        }
+        mailbox_wake(ordinator);
+    }
+}
+
+inline void run() {
+    drive(this_ordinator(), [] {
+        return false;
+    });
+}
+
+inline routine_t current() {
+    Ordinator& ordinator = this_ordinator();
+    return ordinator.running != nullptr ? ordinator.running->id : 0;
+}
+
+//move a routine of this thread to another ready queue class; -1 for a bad handle
+inline int set_priority(routine_t id, Priority priority) {
+    Ordinator& ordinator = this_ordinator();
+    Routine *routine = lookup(ordinator, id);
+    if (routine == nullptr) {
+        return -1;
+    }
+    if (routine->queued) {
+        unlink(ordinator, routine);
+        routine->priority = priority;
+        enqueue(ordinator, routine);
+    } else {
+        routine->priority = priority;
+    }
+    return 0;
+}
+
+#if COROUTINE_PROFILE
+
+//time the running routine has spent switched in so far, including the
+//current slice; zero from the main context
+inline std::chrono::nanoseconds cpu_time() {
+    Ordinator& ordinator = this_ordinator();
+    Routine *routine = ordinator.running;
+    if (routine == nullptr) {
+        return std::chrono::nanoseconds(0);
+    }
+    uint64_t current = cpu_ticks() - ordinator.slice.start.load(std::memory_order_relaxed);
+    return ticks_to_duration(routine->cpu_ticks + current);
+}
+
+//time a routine of this thread has spent switched in, -1 ns for a bad handle
+inline std::chrono::nanoseconds cpu_time(routine_t id) {
+    Ordinator& ordinator = this_ordinator();
+    Routine *routine = lookup(ordinator, id);
+    if (routine == nullptr) {
+        return std::chrono::nanoseconds(-1);
+    }
+    if (routine == ordinator.running) {
+        return cpu_time();
+    }
+    return ticks_to_duration(routine->cpu_ticks);
+}
+
+//a run slice that went over the Watchdog threshold
+struct Stall {
+    routine_t id;
+    //RoutineOptions::tag, nullptr if none was given
+    const char *tag;
+    std::thread::id thread;
+    //how long it had been running when it was seen
+    std::chrono::nanoseconds running;
+};
+
+inline void print_stall(const Stall& stall) {
+    std::fprintf(stderr, "coroutine: routine %llu (%s) running for %lld us without a switch\n",
+                 static_cast<unsigned long long>(stall.id), stall.tag != nullptr ? stall.tag : "untagged",
+                 static_cast<long long>(stall.running.count() / 1000));
+}
+
+//thread that looks at every thread's running slice each threshold / 2 and
+//reports a routine that has not switched out for longer than threshold,
+//once per slice. The report runs on the watchdog thread while the routine
+//still runs, it may only read the Stall.
+class Watchdog {
+public:
+    explicit Watchdog(std::chrono::nanoseconds threshold,
+                      std::function<void(const Stall&)> report = &print_stall)
+        : threshold_(threshold)
+        , report_(std::move(report))
+        , stop_(false) {
+        assert(threshold.count() > 0);
+        //calibrate before the first slice is judged
+        ticks_per_ns();
+        thread_ = std::thread(&Watchdog::watch, this);
+    }
+
+    ~Watchdog() {
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            stop_ = true;
+        }
+        cv_.notify_all();
+        thread_.join();
+    }
+
+    Watchdog(const Watchdog&) = delete;
+    Watchdog& operator=(const Watchdog&) = delete;
+
+private:
+    struct Seen {
+        const Slice *slice;
+        uint64_t serial;
+    };
+
+    inline void watch() {
+        std::vector<Seen> reported;
+        std::vector<Stall> stalls;
+        std::unique_lock<std::mutex> lock(mutex_);
+        while (!cv_.wait_for(lock, threshold_ / 2, [this] { return stop_; })) {
+            lock.unlock();
+            scan(reported, stalls);
+            for (const Stall& stall : stalls) {
+                report_(stall);
+            }
+            stalls.clear();
+            lock.lock();
+        }
+    }
+
+    inline void scan(std::vector<Seen>& reported, std::vector<Stall>& stalls) {
+        const double rate = ticks_per_ns();
+        const uint64_t limit = uint64_t(double(threshold_.count()) * rate);
+        SliceRegistry& registry = slice_registry();
+        std::lock_guard<std::mutex> lock(registry.mutex);
+        //forget threads that exited
+        reported.erase(std::remove_if(reported.begin(), reported.end(), [&registry](const Seen& seen) {
+            return std::find(registry.slices.begin(), registry.slices.end(), seen.slice) == registry.slices.end();
+        }), reported.end());
+
+        const uint64_t now = cpu_ticks();
+        for (const Slice *slice : registry.slices) {
+            uint64_t serial = slice->serial.load(std::memory_order_relaxed);
+            uint64_t start = slice->start.load(std::memory_order_acquire);
+            if (start == 0 || now < start || now - start <= limit) {
+                continue;
+            }
+            Stall stall = { slice->id.load(std::memory_order_relaxed), slice->tag.load(std::memory_order_relaxed),
+                            slice->thread, std::chrono::nanoseconds(int64_t(double(now - start) / rate)) };
+            //the slice may have ended while it was read
+            if (slice->serial.load(std::memory_order_acquire) != serial) {
+                continue;
+            }
+            auto seen = std::find_if(reported.begin(), reported.end(), [slice](const Seen& entry) {
+                return entry.slice == slice;
+            });
+            if (seen == reported.end()) {
+                reported.push_back(Seen{ slice, serial });
+            } else if (seen->serial == serial) {
+                continue;
+            } else {
+                seen->serial = serial;
+            }
+            stalls.push_back(stall);
+        }
+    }
+
+    std::chrono::nanoseconds threshold_;
+    std::function<void(const Stall&)> report_;
+    std::mutex mutex_;
+    std::condition_variable cv_;
+    bool stop_;
+    std::thread thread_;
+};
+
+#endif
+
+#if COROUTINE_STATS
+
+inline void stats_accumulate(Stats& total, const ThreadStats& thread) {
+    total.live += thread.live.load(std::memory_order_relaxed);
+    total.runnable += thread.runnable.load(std::memory_order_relaxed);
+    total.waiting += thread.waiting.load(std::memory_order_relaxed);
+    total.finished += thread.finished.load(std::memory_order_relaxed);
+    total.switches += thread.switches.load(std::memory_order_relaxed);
+    total.stack_peak = std::max(total.stack_peak, thread.stack_peak.load(std::memory_order_relaxed));
+    total.channel_high_water = std::max(total.channel_high_water,
+                                        thread.channel_high_water.load(std::memory_order_relaxed));
+}
+
+inline Stats stats_shared() {
+    StatsRegistry& registry = stats_registry();
+    Stats total = Stats();
+    total.stack_reserved = registry.stack_reserved.load(std::memory_order_relaxed);
+    total.stack_committed = registry.stack_committed.load(std::memory_order_relaxed);
+    total.await_threads = registry.await_threads.load(std::memory_order_relaxed);
+    total.await_busy = registry.await_busy.load(std::memory_order_relaxed);
+    total.await_queued = registry.await_queued.load(std::memory_order_relaxed);
+    total.await_calls = registry.await_calls.load(std::memory_order_relaxed);
+    return total;
+}
+
+//counters of every thread, including those that exited, added up
+inline Stats stats() {
+    Stats total = stats_shared();
+    StatsRegistry& registry = stats_registry();
+    std::lock_guard<std::mutex> lock(registry.mutex);
+    stats_accumulate(total, registry.retired);
+    for (const ThreadStats *thread : registry.threads) {
+        stats_accumulate(total, *thread);
+    }
+    return total;
+}
+
+//counters of the calling thread, stacks and the await pool still process wide
+inline Stats thread_stats() {
+    Stats total = stats_shared();
+    stats_accumulate(total, this_ordinator().stats);
+    return total;
+}
+
+#endif
+
+//RoutineLocal values of the running routine, or of the main context
+inline LocalSlots& local_slots() {
+    Ordinator& ordinator = this_ordinator();
+    return ordinator.running != nullptr ? ordinator.running->locals : ordinator.locals;
+}
+
+inline size_t next_local_index() {
+    static std::atomic<size_t> next(0);
+    return next.fetch_add(1, std::memory_order_relaxed);
+}
+
+//a T per routine, like thread_local but following the routine across
+//yields and workers. The value is created from the initial one on first
+//access and freed with the routine; the main context of every thread has one
+//of its own. The first ROUTINE_LOCAL_SLOTS instances are a plain index into
+//the routine block. Indices are not reused, make them long-lived (static).
+template<typename Type>
+class RoutineLocal {
+public:
+    RoutineLocal()
+        : index_(next_local_index())
+        , initial_() {
+    }
+
+    explicit RoutineLocal(const Type& initial)
+        : index_(next_local_index())
+        , initial_(initial) {
+    }
+
+    RoutineLocal(const RoutineLocal&) = delete;
+    RoutineLocal& operator=(const RoutineLocal&) = delete;
+
+    inline Type& get() {
+        LocalSlot& slot = local_slots().at(index_);
+        if (slot.value == nullptr) {
+            slot.value = new Type(initial_);
+            slot.dispose = &RoutineLocal::dispose;
+        }
+        return *static_cast<Type *>(slot.value);
+    }
+
+    inline Type& operator*() {
+        return get();
+    }
+
+    inline Type *operator->() {
+        return &get();
+    }
+
+    //drop the current routine's value, the next access starts over
+    inline void reset() {
+        LocalSlots::reset(local_slots().at(index_));
+    }
+
+    inline size_t index() const {
+        return index_;
+    }
+
+private:
+    static void dispose(void *value) {
+        delete static_cast<Type *>(value);
+    }
+
+    size_t index_;
+    Type initial_;
+};
+
+//default stack size for routines the calling thread creates from now on
+inline void set_stack_size(size_t size) {
+    assert(size != 0);
+    this_ordinator().stack_size = size;
+}
+
+inline size_t stack_size() {
+    return this_ordinator().stack_size;
+}
+
+inline PoolStats stack_pool_stats() {
+    const StackPool& pool = this_ordinator().stack_pool;
+    return PoolStats{ pool.hits, pool.misses, pool.stacks.size() };
+}
+
+//deepest a routine of this thread was seen on its stack so far, 0 for a bad handle
+inline size_t stack_peak(routine_t id) {
+    Routine *routine = lookup(this_ordinator(), id);
+    return routine != nullptr ? routine->stack_peak : 0;
+}
+
+//peaks of tagged routines that released their stack, in every thread
+inline std::vector<StackProfile> stack_profiles() {
+    StackRegistry& registry = stack_registry();
+    std::lock_guard<std::mutex> lock(registry.mutex);
+    return registry.profiles;
+}
+
+#if COROUTINE_STACK_PAINT && !defined(_MSC_VER)
+
+//size stacks of routines given a tag and no stack_size from the peaks their
+//tag reached so far, process wide; needs COROUTINE_STACK_PAINT
+inline void set_adaptive_stacks(bool enabled) {
+    stack_registry().adaptive.store(enabled, std::memory_order_relaxed);
+}
+
+#endif
+
+//limit how many released stacks the calling thread keeps around
+inline void set_stack_pool_limit(size_t limit) {
+    StackPool& pool = this_ordinator().stack_pool;
+    pool.limit = limit;
+    pool.trim(limit);
+}
+
+//Chase-Lev work-stealing deque: the owning worker pushes and pops at the
+//bottom, any other worker steals from the top
+class WorkDeque {
+public:
+    explicit WorkDeque(size_t capacity = 256)
+        : top_(0)
+        , bottom_(0)
+        , array_(new Array(capacity)) {
+    }
+
+    ~WorkDeque() {
+        delete array_.load(std::memory_order_relaxed);
+    }
+
+    WorkDeque(const WorkDeque&) = delete;
+    WorkDeque& operator=(const WorkDeque&) = delete;
+
+    inline void push(Routine *routine) {
+        int64_t b = bottom_.load(std::memory_order_relaxed);
+        int64_t t = top_.load(std::memory_order_acquire);
+        Array *array = array_.load(std::memory_order_relaxed);
+        if (b - t > int64_t(array->mask)) {
+            array = grow(array, t, b);
+        }
+        array->put(b, routine);
+        std::atomic_thread_fence(std::memory_order_release);
+        bottom_.store(b + 1, std::memory_order_relaxed);
+    }
+
+    inline Routine *pop() {
+        int64_t b = bottom_.load(std::memory_order_relaxed) - 1;
+        Array *array = array_.load(std::memory_order_relaxed);
+        bottom_.store(b, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        int64_t t = top_.load(std::memory_order_relaxed);
+
+        if (t > b) {
+            bottom_.store(b + 1, std::memory_order_relaxed);
+            return nullptr;
+        }
+
+        Routine *routine = array->get(b);
+        if (t == b) {
+            //last element, race the stealers for it
+            if (!top_.compare_exchange_strong(t, t + 1, std::memory_order_seq_cst,
+                                              std::memory_order_relaxed)) {
+                routine = nullptr;
+            }
+            bottom_.store(b + 1, std::memory_order_relaxed);
+        }
+        return routine;
+    }
+
+    inline Routine *steal() {
+        int64_t t = top_.load(std::memory_order_acquire);
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        int64_t b = bottom_.load(std::memory_order_acquire);
+        if (t >= b) {
+            return nullptr;
+        }
+
+        Array *array = array_.load(std::memory_order_acquire);
+        Routine *routine = array->get(t);
+        if (!top_.compare_exchange_strong(t, t + 1, std::memory_order_seq_cst,
+                                          std::memory_order_relaxed)) {
+            return nullptr;
+        }
+        return routine;
+    }
+
+    inline bool empty() const {
+        int64_t t = top_.load(std::memory_order_relaxed);
+        int64_t b = bottom_.load(std::memory_order_relaxed);
+        return t >= b;
+    }
+
+private:
+    struct Array {
+        size_t mask;
+        std::unique_ptr<std::atomic<Routine *>[]> items;
+
+        explicit Array(size_t capacity)
+            : mask(capacity - 1)
+            , items(new std::atomic<Routine *>[capacity]) {
+            assert((capacity & mask) == 0);
+        }
+
+        inline Routine *get(int64_t i) const {
+            return items[size_t(i) & mask].load(std::memory_order_relaxed);
+        }
+
+        inline void put(int64_t i, Routine *routine) {
+            items[size_t(i) & mask].store(routine, std::memory_order_relaxed);
+        }
+    };
+
+    //stealers may still read the old array, it is retired rather than freed
+    inline Array *grow(Array *array, int64_t t, int64_t b) {
+        Array *bigger = new Array((array->mask + 1) * 2);
+        for (int64_t i = t; i < b; ++i) {
+            bigger->put(i, array->get(i));
+        }
+        retired_.emplace_back(array);
+        array_.store(bigger, std::memory_order_release);
+        return bigger;
+    }
+
+    //stealers move top_, the owner bottom_: a cache line apart. Padding, not
+    //alignas, since workers are allocated with a plain new before C++17.
+    std::atomic<int64_t> top_;
+    char top_pad_[kCacheLine - sizeof(std::atomic<int64_t>)];
+    std::atomic<int64_t> bottom_;
+    std::atomic<Array *> array_;
+    std::vector<std::unique_ptr<Array>> retired_;
+};
+
+//M:N scheduler: routines spawned here run on a fixed set of worker threads,
+//each worker keeps its own run queue and idle workers steal from the others,
+//so a routine may continue on a different thread after every yield()
+class Scheduler {
+public:
+    explicit Scheduler(size_t workers = std::thread::hardware_concurrency(),
+                       size_t stack_size = STACK_LIMIT)
+        : stack_size_(stack_size)
+        , inject_head_(nullptr)
+        , inject_tail_(nullptr)
+        , injected_(0)
+        , sleepers_(0)
+        , signals_(0)
+        , timer_count_(0)
+        , next_deadline_(0)
+        , live_(0)
+        , serial_(0)
+        , stop_(false) {
+        if (workers == 0) {
+            workers = 1;
+        }
+        for (size_t i = 0; i < workers; ++i) {
+            workers_.emplace_back(new Worker(uint32_t(i + 1)));
+        }
+        for (size_t i = 0; i < workers; ++i) {
+            workers_[i]->thread = std::thread(&Scheduler::work, this, i);
+        }
+    }
+
+    //waits for every spawned routine to finish, then stops the workers
+    ~Scheduler() {
+        wait();
+        {
+            std::lock_guard<std::mutex> lock(idle_mutex_);
+            stop_.store(true, std::memory_order_release);
+        }
+        idle_cv_.notify_all();
+        for (auto& worker : workers_) {
+            worker->thread.join();
+        }
+    }
+
+    Scheduler(const Scheduler&) = delete;
+    Scheduler& operator=(const Scheduler&) = delete;
+
+    //shared-stack routines are pinned to one thread and can not be spawned here
+    template<typename Function>
+    void spawn(Function&& func, const RoutineOptions& options = RoutineOptions()) {
+        void *block = allocate_block();
+        Routine *routine = new (block) Routine(options);
+        try {
+            routine->bind(std::forward<Function>(func));
+        } catch (...) {
+            routine->~Routine();
+            ::operator delete(block);
+            throw;
+        }
+        assert(!routine->shared);
+        routine->shared = false;
+        routine->scheduler = this;
+        routine->node = current_node();
+        if (routine->stack_size == 0) {
+            routine->stack_size = adaptive_stack_size(routine->tag, stack_size_);
+        }
+        //no slot index, so the handle never resolves through resume()/destroy()
+        routine->id = routine_t(serial_.fetch_add(1, std::memory_order_relaxed) + 1) << 32;
+
+        live_.fetch_add(1, std::memory_order_relaxed);
+        COROUTINE_COUNT(this_ordinator(), live, 1);
+        schedule(routine);
+    }
+
+    //block the calling thread until every spawned routine has finished,
+    //must not be called from one of the scheduler's routines
+    inline void wait() {
+        assert(this_ordinator().scheduler != this);
+        std::unique_lock<std::mutex> lock(done_mutex_);
+        done_cv_.wait(lock, [this] {
+            return live_.load(std::memory_order_acquire) == 0;
+        });
+    }
+
+    inline size_t worker_count() const {
+        return workers_.size();
+    }
+
+    //make a suspended routine of this scheduler runnable again
+    inline void schedule(Routine *routine) {
+        Ordinator& ordinator = this_ordinator();
+        COROUTINE_COUNT(ordinator, runnable, 1);
+        if (ordinator.scheduler == this) {
+            workers_[ordinator.worker]->deque.push(routine);
+        } else {
+            std::lock_guard<std::mutex> lock(inject_mutex_);
+            routine->next = nullptr;
+            if (inject_tail_ != nullptr) {
+                inject_tail_->next = routine;
+            } else {
+                inject_head_ = routine;
+            }
+            inject_tail_ = routine;
+            injected_.fetch_add(1, std::memory_order_release);
+        }
+        notify();
+    }
+
+    //arm the timer of a timed wait, routine->deadline is set
+    inline void add_timer(Routine *routine) {
+        {
+            std::lock_guard<std::mutex> lock(timer_mutex_);
+            timers_.push(routine);
+            update_deadline();
+        }
+        //an idle worker may have to wake up earlier now
+        notify();
+    }
+
+    inline void cancel_timer(Routine *routine) {
+        std::lock_guard<std::mutex> lock(timer_mutex_);
+        timers_.remove(routine);
+        update_deadline();
+    }
+
+private:
+    //how often a worker looks at shared queues before its own deque
+    static constexpr uint32_t kFairnessTick = 61;
+    //routine blocks a worker keeps for its next spawns
+    static constexpr size_t kBlockCacheLimit = 256;
+
+    struct Worker {
+        WorkDeque deque;
+        //routines that yielded on this worker, run after the deque so a
+        //yielding routine does not starve the others
+        Routine *yielded_head;
+        Routine *yielded_tail;
+        uint32_t tick;
+        uint32_t seed;
+        //NUMA node it last ran on, stealers read it
+        std::atomic<int> node;
+        //blocks of routines that finished here, on this worker's node
+        std::vector<void *> blocks;
+        std::thread thread;
+        //keeps the next worker's deque off the line of this one's fields
+        char pad[kCacheLine];
+
+        explicit Worker(uint32_t s)
+            : yielded_head(nullptr)
+            , yielded_tail(nullptr)
+            , tick(0)
+            , seed(s)
+            , node(0) {
+        }
+
+        ~Worker() {
+            for (void *block : blocks) {
+                ::operator delete(block);
+            }
+        }
+    };
+
+    inline void work(size_t index) {
+        Ordinator& ordinator = this_ordinator();
+        ordinator.scheduler = this;
+        ordinator.worker = index;
+        Worker& worker = *workers_[index];
+        worker.node.store(current_node(), std::memory_order_relaxed);
+
+        for (;;) {
+            Routine *routine = next(worker);
+            if (routine == nullptr) {
+                if (!idle()) {
+                    break;
+                }
+                continue;
+            }
+            COROUTINE_COUNT(ordinator, runnable, -1);
+
+            //a suspended routine may already run on, or have finished on,
+            //another worker
+            if (switch_in(ordinator, routine)) {
+                continue;
+            }
+
+            if (routine->finished) {
+                finish(routine);
+            } else {
+                COROUTINE_COUNT(ordinator, runnable, 1);
+                routine->next = nullptr;
+                if (worker.yielded_tail != nullptr) {
+                    worker.yielded_tail->next = routine;
+                } else {
+                    worker.yielded_head = routine;
+                }
+                worker.yielded_tail = routine;
+            }
+        }
+        ordinator.scheduler = nullptr;
+    }
+
+    inline Routine *next(Worker& worker) {
+        Routine *routine = nullptr;
+        if (++worker.tick % kFairnessTick == 0) {
+            fire_timers();
+            routine = take_injected();
+            if (routine == nullptr) {
+                routine = take_yielded(worker);
+            }
+            if (routine != nullptr) {
+                return routine;
+            }
+        }
+
+        routine = worker.deque.pop();
+        if (routine != nullptr) {
+            return routine;
+        }
+
+        //hand the yielded routines to the deque so idle workers can steal them
+        if (worker.yielded_head != nullptr) {
+            Routine *first = take_yielded(worker);
+            if (worker.yielded_head != nullptr) {
+                std::vector<Routine *> rest;
+                while (worker.yielded_head != nullptr) {
+                    rest.push_back(take_yielded(worker));
+                }
+                for (size_t i = rest.size(); i > 0; --i) {
+                    worker.deque.push(rest[i - 1]);
+                }
+                notify();
+            }
+            return first;
+        }
+
+        //expired timers go to this worker's deque
+        if (fire_timers()) {
+            routine = worker.deque.pop();
+            if (routine != nullptr) {
+                return routine;
+            }
+        }
+
+        routine = take_injected();
+        if (routine != nullptr) {
+            return routine;
+        }
+        return steal(worker);
+    }
+
+    //must hold timer_mutex_
+    inline void update_deadline() {
+        timer_count_.store(timers_.size(), std::memory_order_relaxed);
+        if (!timers_.empty()) {
+            next_deadline_.store(timers_.top()->deadline.time_since_epoch().count(),
+                                 std::memory_order_relaxed);
+        }
+    }
+
+    inline std::chrono::steady_clock::time_point next_deadline() const {
+        return std::chrono::steady_clock::time_point(
+            std::chrono::steady_clock::duration(next_deadline_.load(std::memory_order_relaxed)));
+    }
+
+    //claim the timed waits whose deadline passed, true if there were any
+    inline bool fire_timers() {
+        if (timer_count_.load(std::memory_order_relaxed) == 0) {
+            return false;
+        }
+        const std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+        if (next_deadline() > now) {
+            return false;
+        }
+
+        bool fired = false;
+        std::lock_guard<std::mutex> lock(timer_mutex_);
+        while (!timers_.empty() && timers_.top()->deadline <= now) {
+            Routine *routine = timers_.top();
+            timers_.remove(routine);
+            fired |= claim(routine, routine->timer_epoch, true);
+        }
+        update_deadline();
+        return fired;
+    }
+
+    inline Routine *take_yielded(Worker& worker) {
+        Routine *routine = worker.yielded_head;
+        if (routine != nullptr) {
+            worker.yielded_head = routine->next;
+            if (worker.yielded_head == nullptr) {
+                worker.yielded_tail = nullptr;
+            }
+            routine->next = nullptr;
+        }
+        return routine;
+    }
+
+    inline Routine *take_injected() {
+        if (injected_.load(std::memory_order_acquire) == 0) {
+            return nullptr;
+        }
+        std::lock_guard<std::mutex> lock(inject_mutex_);
+        Routine *routine = inject_head_;
+        if (routine != nullptr) {
+            inject_head_ = routine->next;
+            if (inject_head_ == nullptr) {
+                inject_tail_ = nullptr;
+            }
+            routine->next = nullptr;
+            injected_.fetch_sub(1, std::memory_order_relaxed);
+        }
+        return routine;
+    }
+
+    //victims on the worker's own NUMA node first, whose routines' stacks and
+    //blocks are local to it, the others only once those came up empty
+    inline Routine *steal(Worker& self) {
+        const size_t count = workers_.size();
+        //xorshift, only used to spread the victims
+        self.seed ^= self.seed << 13;
+        self.seed ^= self.seed >> 17;
+        self.seed ^= self.seed << 5;
+        size_t start = self.seed % count;
+
+        const bool numa = topology().nodes > 1;
+        const int node = current_node();
+        self.node.store(node, std::memory_order_relaxed);
+        for (int pass = numa ? 0 : 1; pass < 2; ++pass) {
+            for (size_t i = 0; i < count; ++i) {
+                Worker& victim = *workers_[(start + i) % count];
+                if (&victim == &self) {
+                    continue;
+                }
+                if (numa && (victim.node.load(std::memory_order_relaxed) == node) != (pass == 0)) {
+                    continue;
+                }
+                Routine *routine = victim.deque.steal();
+                if (routine != nullptr) {
+                    return routine;
+                }
+            }
+        }
+        return nullptr;
+    }
+
+    inline bool has_work() const {
+        if (injected_.load(std::memory_order_relaxed) != 0) {
+            return true;
+        }
+        for (auto& worker : workers_) {
+            if (!worker->deque.empty()) {
+                return true;
+            }
+        }
+        return false;
+    }
+
+    //park the worker until new work shows up, false once the scheduler stops
+    inline bool idle() {
+        std::unique_lock<std::mutex> lock(idle_mutex_);
+        sleepers_.fetch_add(1, std::memory_order_seq_cst);
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        if (!has_work()) {
+            auto woken = [this] {
+                return signals_ > 0 || stop_.load(std::memory_order_acquire);
+            };
+            //some worker has to be around when the next timer expires
+            if (timer_count_.load(std::memory_order_relaxed) != 0) {
+                idle_cv_.wait_until(lock, next_deadline(), woken);
+            } else {
+                idle_cv_.wait(lock, woken);
+            }
+            if (signals_ > 0) {
+                --signals_;
+            }
+        }
+        sleepers_.fetch_sub(1, std::memory_order_relaxed);
+        return !stop_.load(std::memory_order_acquire);
+    }
+
+    inline void notify() {
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        if (sleepers_.load(std::memory_order_relaxed) == 0) {
+            return;
+        }
+        {
+            std::lock_guard<std::mutex> lock(idle_mutex_);
+            ++signals_;
+        }
+        idle_cv_.notify_one();
+    }
+
+    //a spawn on a worker reuses a block that finished there, so it is on
+    //that worker's node and warm in its cache
+    inline void *allocate_block() {
+        Ordinator& ordinator = this_ordinator();
+        if (ordinator.scheduler == this) {
+            std::vector<void *>& blocks = workers_[ordinator.worker]->blocks;
+            if (!blocks.empty()) {
+                void *block = blocks.back();
+                blocks.pop_back();
+                return block;
+            }
+        }
+        return ::operator new(sizeof(Routine));
+    }
+
+    //called on the worker the routine finished on
+    inline void finish(Routine *routine) {
+        Ordinator& ordinator = this_ordinator();
+        COROUTINE_COUNT(ordinator, live, -1);
+        const int node = routine->node;
+        routine->~Routine();
+        std::vector<void *>& blocks = workers_[ordinator.worker]->blocks;
+        if (blocks.size() < kBlockCacheLimit && node == current_node()) {
+            blocks.push_back(routine);
+        } else {
+            ::operator delete(routine);
+        }
+        if (live_.fetch_sub(1, std::memory_order_acq_rel) == 1) {
+            std::lock_guard<std::mutex> lock(done_mutex_);
+            done_cv_.notify_all();
+        }
+    }
+
+    size_t stack_size_;
+    std::vector<std::unique_ptr<Worker>> workers_;
+
+    std::mutex inject_mutex_;
+    Routine *inject_head_;
+    Routine *inject_tail_;
+    std::atomic<size_t> injected_;
+
+    //every schedule() reads sleepers_, keep it off the injection lock's line
+    char idle_pad_[kCacheLine];
+    std::mutex idle_mutex_;
+    std::condition_variable idle_cv_;
+    std::atomic<size_t> sleepers_;
+    size_t signals_;
+
+    //timed waits of scheduled routines
+    std::mutex timer_mutex_;
+    TimerHeap timers_;
+    std::atomic<size_t> timer_count_;
+    std::atomic<std::chrono::steady_clock::duration::rep> next_deadline_;
+
+    //live_ and serial_ change with every spawn and finish
+    char done_pad_[kCacheLine];
+    std::mutex done_mutex_;
+    std::condition_variable done_cv_;
+    std::atomic<size_t> live_;
+    std::atomic<uint32_t> serial_;
+    std::atomic<bool> stop_;
+};
+
+//hand a suspended routine back from any thread: to its scheduler, or to the
+//thread that owns it, waking that thread if it sleeps in run()
+inline void ready(Routine *routine) {
+    if (routine->scheduler != nullptr) {
+        routine->scheduler->schedule(routine);
+        return;
+    }
+
+    Ordinator& home = *routine->home;
+    if (&home == &this_ordinator()) {
+        routine->waiting = false;
+        enqueue(home, routine);
+        return;
+    }
+    //an awake owner drains it on its next pass, nothing to tell it. After
+    //the push the owner may run the routine and exit, home is not touched again.
+    Routine *head = home.mailbox.load(std::memory_order_relaxed);
+    while (head != mailbox_asleep()) {
+        routine->next = head;
+        if (home.mailbox.compare_exchange_weak(head, routine, std::memory_order_release,
+                                               std::memory_order_relaxed)) {
+            return;
+        }
+    }
+
+    //the owner sleeps: whoever replaces the mark wakes it, under the lock it
+    //needs to leave its sleep, all later wakers of the batch just push
+    std::lock_guard<std::mutex> lock(home.remote_mutex);
+    head = home.mailbox.load(std::memory_order_relaxed);
+    do {
+        routine->next = head == mailbox_asleep() ? nullptr : head;
+    } while (!home.mailbox.compare_exchange_weak(head, routine, std::memory_order_release,
+                                                 std::memory_order_relaxed));
+    if (head != mailbox_asleep()) {
+        return;
+    }
+#ifdef COROUTINE_REACTOR
+    if (home.polling) {
+        home.reactor->interrupt();
+        return;
+    }
+#endif
+    home.remote_cv.notify_one();
+}
+
+inline bool claim(Routine *routine, uint64_t epoch, bool timeout) {
+    const uint64_t reason = timeout ? uint64_t(kWaitTimedOut) : 0;
+    uint64_t state = routine->wait_state.load(std::memory_order_acquire);
+    for (;;) {
+        if (state >> kWaitEpochShift != epoch) {
+            return false;
+        }
+        uint64_t base = state & ~kWaitPhase;
+        switch (state & kWaitPhase) {
+        case kWaitArmed:
+            if (routine->wait_state.compare_exchange_weak(state, base | reason | kWaitClaimed,
+                                                          std::memory_order_acq_rel,
+                                                          std::memory_order_acquire)) {
+                return true;
+            }
+            break;
+        case kWaitSuspended:
+            if (routine->wait_state.compare_exchange_weak(state, base | reason | kWaitIdle,
+                                                          std::memory_order_acq_rel,
+                                                          std::memory_order_acquire)) {
+                COROUTINE_COUNT(this_ordinator(), waiting, -1);
+                ready(routine);
+                return true;
+            }
+            break;
+        default:
+            return false;
+        }
+    }
+}
+
+//mark a cancel pending and end the routine's current wait as cancelled,
+//unless it is shielded; callable from any thread
+inline void request_cancel(Routine *routine) {
+    uint64_t state = routine->wait_state.load(std::memory_order_acquire);
+    for (;;) {
+        const uint64_t base = (state & ~kWaitPhase) | kWaitCancelPending;
+        const uint64_t phase = state & kWaitPhase;
+        if ((state & kWaitShielded) != 0 || (phase != kWaitArmed && phase != kWaitSuspended)) {
+            //running, or its wait is over already: the next wait ends at once
+            if ((state & kWaitCancelPending) != 0
+                || routine->wait_state.compare_exchange_weak(state, base | phase, std::memory_order_acq_rel,
+                                                             std::memory_order_acquire)) {
+                return;
+            }
+            continue;
+        }
+        const uint64_t next = base | kWaitCancelled | (phase == kWaitArmed ? kWaitClaimed : kWaitIdle);
+        if (routine->wait_state.compare_exchange_weak(state, next, std::memory_order_acq_rel,
+                                                      std::memory_order_acquire)) {
+            if (phase == kWaitSuspended) {
+                COROUTINE_COUNT(this_ordinator(), waiting, -1);
+                ready(routine);
+            }
+            return;
+        }
+    }
+}
+
+//end the suspended wait of a routine destroy() frees as cancelled, without
+//handing it back, so any later claim fails; false if a waker was first.
+//A shielded wait is left to its waker.
+inline bool abandon_wait(Routine *routine) {
+    uint64_t state = routine->wait_state.load(std::memory_order_acquire);
+    while ((state & kWaitShielded) == 0 && (state & kWaitPhase) == kWaitSuspended) {
+        if (routine->wait_state.compare_exchange_weak(state, (state & ~kWaitPhase) | kWaitCancelled | kWaitIdle,
+                                                      std::memory_order_acq_rel,
+                                                      std::memory_order_acquire)) {
+            COROUTINE_COUNT(this_ordinator(), waiting, -1);
+            routine->waiting = false;
+            return true;
+        }
+    }
+    return false;
+}
+
+inline void CancelToken::attach(Routine *routine) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    routine->token_next = head_;
+    if (head_ != nullptr) {
+        head_->token_prev = routine;
+    }
+    head_ = routine;
+    if (cancelled_.load(std::memory_order_relaxed)) {
+        routine->wait_state.fetch_or(kWaitCancelPending, std::memory_order_relaxed);
+    }
+}
+
+inline void CancelToken::detach(Routine *routine) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (routine->token_prev != nullptr) {
+        routine->token_prev->token_next = routine->token_next;
+    } else {
+        head_ = routine->token_next;
+    }
+    if (routine->token_next != nullptr) {
+        routine->token_next->token_prev = routine->token_prev;
+    }
+}
+
+//routines stay alive while linked, they unlink under the same lock
+inline void CancelToken::cancel() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    cancelled_.store(true, std::memory_order_release);
+    for (Routine *routine = head_; routine != nullptr; routine = routine->token_next) {
+        request_cancel(routine);
+    }
+}
+
+//queue a parked routine on its thread's ready queue, or on its scheduler,
+//routines that are not parked are left alone
+inline void wake(Routine *routine) {
+    uint64_t state = routine->wait_state.load(std::memory_order_acquire);
+    if ((state & kWaitPark) != 0) {
+        claim(routine, state >> kWaitEpochShift);
+    }
+}
+
+inline void wake(routine_t id) {
+    Routine *routine = lookup(this_ordinator(), id);
+    if (routine != nullptr) {
+        wake(routine);
+    }
+}
+
+//ask a routine of this thread to stop: the wait it is suspended in, or the
+//next one it begins, throws Cancelled in it so its frames unwind and it
+//finishes, giving its stack back. An offload() call is waited for first,
+//yield() is no suspension point. -1 for a bad handle.
+inline int cancel(routine_t id) {
+    Routine *routine = lookup(this_ordinator(), id);
+    if (routine == nullptr) {
+        return -1;
+    }
+    if (!routine->finished) {
+        request_cancel(routine);
+    }
+    return 0;
+}
+
+//whether the running routine has a cancel coming, for loops that do not wait
+inline bool cancelled() {
+    Routine *routine = this_ordinator().running;
+    return routine != nullptr
+           && (routine->wait_state.load(std::memory_order_acquire) & kWaitCancelPending) != 0;
+}
+
+//timed waits: arm before suspend_wait(), cancel once resumed
+inline void add_timer(Routine *routine, std::chrono::steady_clock::time_point deadline, uint64_t epoch) {
+    routine->deadline = deadline;
+    routine->timer_epoch = epoch;
+    if (routine->scheduler != nullptr) {
+        routine->scheduler->add_timer(routine);
+    } else {
+        routine->home->timers.push(routine);
+    }
+}
+
+inline void cancel_timer(Routine *routine) {
+    if (routine->scheduler != nullptr) {
+        routine->scheduler->cancel_timer(routine);
+    } else {
+        routine->home->timers.remove(routine);
+    }
+}
+
+//suspend the calling routine until deadline, other routines run meanwhile.
+//Outside a routine the thread sleeps.
+inline void sleep_until(std::chrono::steady_clock::time_point deadline) {
+    Routine *routine = this_ordinator().running;
+    if (routine == nullptr) {
+        std::this_thread::sleep_until(deadline);
+        return;
+    }
+    uint64_t epoch = begin_wait(routine);
+    add_timer(routine, deadline, epoch);
+    suspend_wait(routine);
+    if (wait_cancelled(routine)) {
+        cancel_timer(routine);
+        throw_cancelled(routine);
+    }
+}
+
+template<typename Rep, typename Period>
+void sleep_for(const std::chrono::duration<Rep, Period>& duration) {
+    sleep_until(std::chrono::steady_clock::now()
+                + std::chrono::duration_cast<std::chrono::steady_clock::duration>(duration));
+}
+
+//park() that gives up at deadline, false if it timed out rather than woken
+inline bool park_until(std::chrono::steady_clock::time_point deadline) {
+    Routine *routine = this_ordinator().running;
+    assert(routine != nullptr);
+    uint64_t epoch = begin_wait(routine, kWaitPark);
+    add_timer(routine, deadline, epoch);
+    suspend_wait(routine);
+    cancel_timer(routine);
+    check_cancelled(routine);
+    return !timed_out(routine);
+}
+
+//hand a waiter just taken off its queue back, with that queue's lock held;
+//false if the routine's wait already ended otherwise (its deadline)
+inline bool signal(Waiter *waiter) {
+    Waiter *owner = waiter->group != nullptr ? waiter->group : waiter;
+    if (waiter->routine != nullptr) {
+        if (!claim(waiter->routine, waiter->epoch)) {
+            return false;
+        }
+        //read by the woken routine once it took the queue's lock to unwatch
+        owner->woken = waiter;
+        return true;
+    }
+    Ordinator& home = *waiter->home;
+    std::lock_guard<std::mutex> lock(home.remote_mutex);
+    if (owner->signaled) {
+        return false;
+    }
+    owner->signaled = true;
+    owner->woken = waiter;
+#ifdef COROUTINE_REACTOR
+    if (home.polling) {
+        home.reactor->interrupt();
+    }
+#endif
+    home.remote_cv.notify_all();
+    return true;
+}
+
+inline bool signal_one(WaitQueue& queue) {
+    while (Waiter *waiter = queue.pop_front()) {
+        if (signal(waiter)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+inline size_t signal_all(WaitQueue& queue) {
+    size_t count = 0;
+    while (Waiter *waiter = queue.pop_front()) {
+        count += signal(waiter) ? 1 : 0;
+    }
+    return count;
+}
+
+inline void WaitQueue::pass_on(Waiter *waiter, std::mutex& lock) {
+    if (pass_on_ != nullptr) {
+        pass_on_(owner_, *this, waiter);
+        return;
+    }
+    std::lock_guard<std::mutex> guard(lock);
+    signal_one(*this);
+}
+
+//unlink the waiter of a routine destroy() frees under its queue's lock, so
+//a waker that took it off the queue is done with it; a wakeup it got goes on
+inline void leave_queue(Waiter *waiter, bool signaled) {
+    WaitQueue& queue = *waiter->queue;
+    std::mutex& lock = *waiter->lock;
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        if (waiter->linked) {
+            queue.remove(waiter);
+            signaled = false;
+        }
+    }
+    waiter->queue = nullptr;
+    if (signaled || waiter->handoff != nullptr) {
+        queue.pass_on(waiter, lock);
+    }
+}
+
+//the wait is ended first, through the same claim a waker races in: either
+//the routine's waker fails from then on, or it won and the routine is on
+//its way back, from another thread maybe, and is waited for; a shielded
+//wait always is. Then whatever it waited on lets go of it, a leave hook or
+//its waiters leaving their queues, and the pending count it held is dropped.
+inline void leave_wait(Ordinator& ordinator, Routine *routine) {
+    if (routine->waiting && !abandon_wait(routine)) {
+        while (routine->waiting) {
+            drain_remote(ordinator);
+            std::this_thread::yield();
+        }
+    }
+    if (routine->leave != nullptr) {
+        routine->leave(routine, routine->leave_arg);
+        routine->leave = nullptr;
+    }
+    //ended by a waker rather than its deadline, cancel() or the above
+    const uint64_t state = routine->wait_state.load(std::memory_order_acquire);
+    const bool signaled = (state & (kWaitTimedOut | kWaitCancelled)) == 0;
+
+    if (routine->waiter.queue != nullptr) {
+        leave_queue(&routine->waiter, signaled);
+        --ordinator.pending;
+    }
+    bool selecting = false;
+    for (size_t i = 0; i < routine->select_capacity; ++i) {
+        Waiter& waiter = routine->select_waiters[i];
+        if (waiter.queue != nullptr) {
+            leave_queue(&waiter, signaled && routine->select_waiters[0].woken == &waiter);
+            selecting = true;
+        }
+    }
+    if (selecting) {
+        --ordinator.pending;
+    }
+}
+
+//block in queue until signalled or deadline, like condition_variable::wait:
+//lock guards queue and is held on entry and on return. The caller is linked
+//before ready() is checked, so whoever makes it true without the lock and
+//then looks at queue.waiting() can not slip past. A routine suspends, a
+//thread outside routines waits in local and drives its own routines
+//meanwhile, one may be the other side. False if deadline passed first.
+//Throws Cancelled once unlinked if cancel() ended the wait, unless the waker
+//handed the waiter an element regardless.
+template<typename Check>
+bool wait_in(WaitQueue& queue, std::unique_lock<std::mutex>& lock, Check ready,
+             std::chrono::steady_clock::time_point deadline, Waiter& local) {
+    Ordinator& ordinator = this_ordinator();
+    Routine *routine = ordinator.running;
+    Waiter *waiter = routine != nullptr ? &routine->waiter : &local;
+    waiter->routine = routine;
+    waiter->home = routine != nullptr ? routine->home : &ordinator;
+    waiter->signaled = false;
+    waiter->handoff = nullptr;
+    if (routine != nullptr) {
+        waiter->epoch = begin_wait(routine);
+    }
+
+    queue.push_back(waiter);
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if (ready()) {
+        queue.remove(waiter);
+        return true;
+    }
+    waiter->queue = &queue;
+    waiter->lock = lock.mutex();
+    lock.unlock();
+
+    const bool timed = deadline != std::chrono::steady_clock::time_point::max();
+    bool signaled;
+    if (routine != nullptr) {
+        Ordinator *home = routine->home;
+        if (home != nullptr) {
+            ++home->pending;
+        }
+        if (timed) {
+            add_timer(routine, deadline, waiter->epoch);
+        }
+        suspend_wait(routine);
+        if (timed) {
+            cancel_timer(routine);
+        }
+        if (home != nullptr) {
+            --home->pending;
+        }
+        signaled = !timed_out(routine);
+        lock.lock();
+    } else {
+        //the other side may be a routine of this thread, it runs meanwhile
+        drive(ordinator, [waiter] {
+            return waiter->signaled;
+        }, deadline, true);
+        lock.lock();
+        //taken off the queue means signalled, even if that raced the deadline
+        signaled = !waiter->linked;
+    }
+
+    if (waiter->linked) {
+        queue.remove(waiter);
+    }
+    waiter->queue = nullptr;
+    if (routine != nullptr && waiter->handoff == nullptr) {
+        check_cancelled(routine);
+    }
+    return signaled;
+}
+
+template<typename Check>
+bool wait_in(WaitQueue& queue, std::unique_lock<std::mutex>& lock, Check ready,
+             std::chrono::steady_clock::time_point deadline = std::chrono::steady_clock::time_point::max()) {
+    Waiter local;
+    return wait_in(queue, lock, ready, deadline, local);
+}
+
+//mutex that suspends a waiting routine instead of its thread. Locking and
+//unlocking without contention is one atomic each; it is not tied to a thread,
+//so a scheduled routine may unlock it after moving to another worker.
+class Mutex {
+public:
+    Mutex()
+        : locked_(false) {
+    }
+
+    Mutex(const Mutex&) = delete;
+    Mutex& operator=(const Mutex&) = delete;
+
+    inline bool try_lock() {
+        bool expected = false;
+        return !locked_.load(std::memory_order_relaxed)
+               && locked_.compare_exchange_strong(expected, true, std::memory_order_acquire,
+                                                  std::memory_order_relaxed);
+    }
+
+    inline void lock() {
+        if (try_lock()) {
+            return;
+        }
+        std::unique_lock<std::mutex> guard(mutex_);
+        bool acquired = false;
+        while (!acquired) {
+            wait_in(waiters_, guard, [this, &acquired] {
+                return acquired = try_lock();
+            });
+            acquired = acquired || try_lock();
+        }
+    }
+
+    //pairs with the fence in wait_in()
+    inline void unlock() {
+        locked_.store(false, std::memory_order_release);
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        if (waiters_.waiting() == 0) {
+            return;
+        }
+        std::lock_guard<std::mutex> guard(mutex_);
+        signal_one(waiters_);
+    }
+
+private:
+    std::atomic<bool> locked_;
+    //guards the waiter queue only
+    std::mutex mutex_;
+    WaitQueue waiters_;
+};
+
+//condition variable for Mutex, works with std::unique_lock<Mutex>
+class CondVar {
+public:
+    CondVar() = default;
+
+    CondVar(const CondVar&) = delete;
+    CondVar& operator=(const CondVar&) = delete;
+
+    //false if deadline passed first
+    inline bool wait_until(std::unique_lock<Mutex>& lock, std::chrono::steady_clock::time_point deadline) {
+        bool signaled;
+        try {
+            //linked before the lock is let go, so a notify after it can not be missed
+            std::unique_lock<std::mutex> guard(mutex_);
+            lock.unlock();
+            signaled = wait_in(waiters_, guard, [] {
+                return false;
+            }, deadline);
+        } catch (...) {
+            //cancelled, the caller still owns the lock on the way out
+            lock.lock();
+            throw;
+        }
+        lock.lock();
+        return signaled;
+    }
+
+    inline void wait(std::unique_lock<Mutex>& lock) {
+        wait_until(lock, std::chrono::steady_clock::time_point::max());
+    }
+
+    template<typename Predicate>
+    void wait(std::unique_lock<Mutex>& lock, Predicate ready) {
+        while (!ready()) {
+            wait(lock);
+        }
+    }
+
+    //returns ready() as of the deadline
+    template<typename Predicate>
+    bool wait_until(std::unique_lock<Mutex>& lock, std::chrono::steady_clock::time_point deadline,
+                    Predicate ready) {
+        while (!ready()) {
+            if (!wait_until(lock, deadline)) {
+                return ready();
+            }
+        }
+        return true;
+    }
+
+    template<typename Rep, typename Period>
+    bool wait_for(std::unique_lock<Mutex>& lock, const std::chrono::duration<Rep, Period>& timeout) {
+        return wait_until(lock, std::chrono::steady_clock::now()
+                                + std::chrono::duration_cast<std::chrono::steady_clock::duration>(timeout));
+    }
+
+    template<typename Rep, typename Period, typename Predicate>
+    bool wait_for(std::unique_lock<Mutex>& lock, const std::chrono::duration<Rep, Period>& timeout,
+                  Predicate ready) {
+        return wait_until(lock, std::chrono::steady_clock::now()
+                                + std::chrono::duration_cast<std::chrono::steady_clock::duration>(timeout),
+                          ready);
+    }
+
+    inline void notify_one() {
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        if (waiters_.waiting() == 0) {
+            return;
+        }
+        std::lock_guard<std::mutex> guard(mutex_);
+        signal_one(waiters_);
+    }
+
+    inline void notify_all() {
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        if (waiters_.waiting() == 0) {
+            return;
+        }
+        std::lock_guard<std::mutex> guard(mutex_);
+        signal_all(waiters_);
+    }
+
+private:
+    std::mutex mutex_;
+    WaitQueue waiters_;
+};
+
+//counting semaphore, acquire() suspends the routine while the count is zero
+class Semaphore {
+public:
+    explicit Semaphore(size_t count = 0)
+        : count_(count) {
+    }
+
+    Semaphore(const Semaphore&) = delete;
+    Semaphore& operator=(const Semaphore&) = delete;
+
+    inline bool try_acquire() {
+        size_t count = count_.load(std::memory_order_relaxed);
+        while (count > 0) {
+            if (count_.compare_exchange_weak(count, count - 1, std::memory_order_acquire,
+                                             std::memory_order_relaxed)) {
+                return true;
+            }
+        }
+        return false;
+    }
+
+    //false if deadline passed with the count still zero
+    inline bool acquire_until(std::chrono::steady_clock::time_point deadline) {
+        if (try_acquire()) {
+            return true;
+        }
+        std::unique_lock<std::mutex> guard(mutex_);
+        bool acquired = false;
+        while (!acquired) {
+            bool signaled = wait_in(waiters_, guard, [this, &acquired] {
+                return acquired = try_acquire();
+            }, deadline);
+            acquired = acquired || try_acquire();
+            if (!signaled) {
+                break;
+            }
+        }
+        return acquired;
+    }
+
+    inline void acquire() {
+        acquire_until(std::chrono::steady_clock::time_point::max());
+    }
+
+    template<typename Rep, typename Period>
+    bool acquire_for(const std::chrono::duration<Rep, Period>& timeout) {
+        return acquire_until(std::chrono::steady_clock::now()
+                             + std::chrono::duration_cast<std::chrono::steady_clock::duration>(timeout));
+    }
+
+    inline void release(size_t count = 1) {
+        count_.fetch_add(count, std::memory_order_release);
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        if (waiters_.waiting() == 0) {
+            return;
+        }
+        std::lock_guard<std::mutex> guard(mutex_);
+        while (count > 0 && signal_one(waiters_)) {
+            --count;
+        }
+    }
+
+    //a snapshot
+    inline size_t count() const {
+        return count_.load(std::memory_order_relaxed);
+    }
+
+private:
+    std::atomic<size_t> count_;
+    std::mutex mutex_;
+    WaitQueue waiters_;
+};
+
+//wait() suspends until as many done() calls as add() counted
+class WaitGroup {
+public:
+    WaitGroup()
+        : count_(0) {
+    }
+
+    WaitGroup(const WaitGroup&) = delete;
+    WaitGroup& operator=(const WaitGroup&) = delete;
+
+    inline void add(size_t count = 1) {
+        count_.fetch_add(count, std::memory_order_relaxed);
+    }
+
+    inline void done() {
+        size_t count = count_.fetch_sub(1, std::memory_order_acq_rel);
+        assert(count > 0);
+        if (count != 1) {
+            return;
+        }
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        if (waiters_.waiting() == 0) {
+            return;
+        }
+        std::lock_guard<std::mutex> guard(mutex_);
+        signal_all(waiters_);
+    }
+
+    inline void wait() {
+        if (count_.load(std::memory_order_acquire) == 0) {
+            return;
+        }
+        std::unique_lock<std::mutex> guard(mutex_);
+        while (count_.load(std::memory_order_acquire) != 0) {
+            wait_in(waiters_, guard, [this] {
+                return count_.load(std::memory_order_acquire) == 0;
+            });
+        }
+    }
+
+private:
+    std::atomic<size_t> count_;
+    std::mutex mutex_;
+    WaitQueue waiters_;
+};
+
+//work item of a ThreadPool, linked through next while queued
+struct PoolTask {
+    void (*run)(PoolTask *);
+    PoolTask *next;
+};
+
+//cores the calling thread may run on, in order
+inline std::vector<int> allowed_cores() {
+    std::vector<int> cores;
+#if defined(__linux__)
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    if (sched_getaffinity(0, sizeof(set), &set) == 0) {
+        for (int core = 0; core < CPU_SETSIZE; ++core) {
+            if (CPU_ISSET(core, &set)) {
+                cores.push_back(core);
+            }
+        }
+    }
+#endif
+    if (cores.empty()) {
+        unsigned count = std::max(1u, std::thread::hardware_concurrency());
+        for (unsigned core = 0; core < count; ++core) {
+            cores.push_back(int(core));
+        }
+    }
+    return cores;
+}
+
+//bind thread to one core, false where that is refused or not supported (macOS)
+inline bool pin_thread(std::thread& thread, int core) {
+#if defined(__linux__)
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(core, &set);
+    return pthread_setaffinity_np(thread.native_handle(), sizeof(set), &set) == 0;
+#elif defined(_WIN32)
+    return core < 64 && SetThreadAffinityMask(thread.native_handle(), DWORD_PTR(1) << core) != 0;
+#else
+    (void)thread;
+    (void)core;
+    return false;
+#endif
+}
+
+//fixed set of threads that run blocking calls for await() and offload().
+//Given cores, thread i is pinned to cores[i % cores.size()], best effort.
+class ThreadPool {
+public:
+    explicit ThreadPool(size_t threads, const std::vector<int>& cores = std::vector<int>())
+        : head_(nullptr)
+        , tail_(nullptr)
+        , stop_(false) {
+        if (threads == 0) {
+            threads = 1;
+        }
+        for (size_t i = 0; i < threads; ++i) {
+            threads_.emplace_back(&ThreadPool::work, this);
+            if (!cores.empty()) {
+                pin_thread(threads_.back(), cores[i % cores.size()]);
+            }
+        }
+#if COROUTINE_STATS
+        stats_registry().await_threads.fetch_add(int64_t(threads), std::memory_order_relaxed);
+#endif
+    }
+
+    //runs what is still queued, then joins the threads
+    ~ThreadPool() {
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            stop_ = true;
+        }
+        cv_.notify_all();
+        for (auto& thread : threads_) {
+            thread.join();
+        }
+#if COROUTINE_STATS
+        stats_registry().await_threads.fetch_sub(int64_t(threads_.size()), std::memory_order_relaxed);
+#endif
+    }
+
+    ThreadPool(const ThreadPool&) = delete;
+    ThreadPool& operator=(const ThreadPool&) = delete;
+
+    inline void submit(PoolTask *task) {
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            task->next = nullptr;
+            if (tail_ != nullptr) {
+                tail_->next = task;
+            } else {
+                head_ = task;
+            }
+            tail_ = task;
+        }
+#if COROUTINE_STATS
+        stats_registry().await_queued.fetch_add(1, std::memory_order_relaxed);
+#endif
+        cv_.notify_one();
+    }
+
+    inline size_t thread_count() const {
+        return threads_.size();
+    }
+
+private:
+    inline void work() {
+        for (;;) {
+            PoolTask *task;
+            {
+                std::unique_lock<std::mutex> lock(mutex_);
+                cv_.wait(lock, [this] {
+                    return head_ != nullptr || stop_;
+                });
+                if (head_ == nullptr) {
+                    return;
+                }
+                task = head_;
+                head_ = task->next;
+                if (head_ == nullptr) {
+                    tail_ = nullptr;
+                }
+            }
+#if COROUTINE_STATS
+            StatsRegistry& registry = stats_registry();
+            registry.await_queued.fetch_sub(1, std::memory_order_relaxed);
+            registry.await_busy.fetch_add(1, std::memory_order_relaxed);
+            task->run(task);
+            registry.await_busy.fetch_sub(1, std::memory_order_relaxed);
+            registry.await_calls.fetch_add(1, std::memory_order_relaxed);
+#else
+            task->run(task);
+#endif
+        }
+    }
+
+    std::mutex mutex_;
+    std::condition_variable cv_;
+    PoolTask *head_;
+    PoolTask *tail_;
+    bool stop_;
+    std::vector<std::thread> threads_;
+};
+
+inline ThreadPool& await_pool() {
+    static ThreadPool pool(AWAIT_POOL_SIZE != 0
+                           ? size_t(AWAIT_POOL_SIZE)
+                           : std::max<size_t>(4, std::thread::hardware_concurrency()));
+    return pool;
+}
+
+//blocking calls: file I/O, DNS and the like, shared with await()
+inline ThreadPool& io_pool() {
+    return await_pool();
+}
+
+//CPU-heavy calls, one thread pinned to each core the process may use
+inline ThreadPool& cpu_pool() {
+    static const std::vector<int> cores = allowed_cores();
+    static ThreadPool pool(CPU_POOL_SIZE != 0 ? size_t(CPU_POOL_SIZE) : cores.size(), cores);
+    return pool;
+}
+
+//function and arguments of an await() call, copied like std::async does
+template<typename Function, typename ... Args>
+struct AwaitCall {
+    using Result = decltype(std::declval<Function>()(std::declval<Args>()...));
+
+    std::tuple<Function, Args...> call;
+
+    template<typename ... Params>
+    explicit AwaitCall(Params&& ... params)
+        : call(std::forward<Params>(params)...) {
+    }
+
+    inline Result operator()() {
+        return invoke(std::index_sequence_for<Args...>());
+    }
+
+    template<size_t ... Index>
+    inline Result invoke(std::index_sequence<Index...>) {
+        return std::move(std::get<0>(call))(std::move(std::get<Index + 1>(call))...);
+    }
+};
+
+template<typename Result>
+class AwaitValue {
+public:
+    AwaitValue()
+        : set_(false) {
+    }
+
+    ~AwaitValue() {
+        if (set_) {
+            value()->~Result();
+        }
+    }
+
+    template<typename Call>
+    inline void set(Call& call) {
+        new (&storage_) Result(call());
+        set_ = true;
+    }
+
+    inline Result get() {
+        return std::move(*value());
+    }
+
+private:
+    inline Result *value() {
+        return static_cast<Result *>(static_cast<void *>(&storage_));
+    }
+
+    typename std::aligned_storage<sizeof(Result), alignof(Result)>::type storage_;
+    bool set_;
+};
+
+template<typename Result>
+class AwaitValue<Result&> {
+public:
+    template<typename Call>
+    inline void set(Call& call) {
+        value_ = &call();
+    }
+
+    inline Result& get() {
+        return *value_;
+    }
+
+private:
+    Result *value_ = nullptr;
+};
+
+template<>
+class AwaitValue<void> {
+public:
+    template<typename Call>
+    inline void set(Call& call) {
+        call();
+    }
+
+    inline void get() {
+    }
+};
+
+//lives on the heap, not on the routine's stack, which may be copied away
+//(shared stack) while the pool thread writes the result
+template<typename Call>
+struct AwaitTask : PoolTask {
+    enum : int {
+        kPending,
+        //the call returned
+        kDone,
+        //the call returned after the routine timed out, the pool thread is
+        //done with the routine
+        kReleased,
+        //the routine timed out and left, the pool thread frees the task
+        kAbandoned
+    };
+
+    Call call;
+    AwaitValue<typename Call::Result> value;
+    std::exception_ptr error;
+    Routine *waiter;
+    //set once the wait is armed, after the task is allocated
+    uint64_t epoch;
+    std::atomic<int> state;
+
+    template<typename ... Params>
+    explicit AwaitTask(Routine *routine, Params&& ... params)
+        : call(std::forward<Params>(params)...)
+        , waiter(routine)
+        , epoch(0)
+        , state(kPending) {
+        run = &AwaitTask::complete;
+        next = nullptr;
+    }
+
+    static void complete(PoolTask *base) {
+        AwaitTask *task = static_cast<AwaitTask *>(base);
+        try {
+            task->value.set(task->call);
+        } catch (...) {
+            task->error = std::current_exception();
+        }
+        //once claimed the routine may free the task at any time
+        Routine *waiter = task->waiter;
+        uint64_t epoch = task->epoch;
+        if (task->state.exchange(kDone, std::memory_order_acq_rel) == kAbandoned) {
+            delete task;
+            return;
+        }
+        if (!claim(waiter, epoch)) {
+            task->state.store(kReleased, std::memory_order_release);
+        }
+    }
+
+    //the routine's wait ended by its deadline or cancel(): true if the pool
+    //thread will free the task, else the call returned just in time and this
+    //waits for the pool thread to let go of the routine
+    inline bool abandon() {
+        int expected = kPending;
+        if (state.compare_exchange_strong(expected, kAbandoned, std::memory_order_acq_rel,
+                                          std::memory_order_acquire)) {
+            return true;
+        }
+        while (state.load(std::memory_order_acquire) != kReleased) {
+            std::this_thread::yield();
+        }
+        return false;
+    }
+
+    //the waiting routine was destroyed
+    static void leave(Routine *routine, void *arg) {
+        AwaitTask *task = static_cast<AwaitTask *>(arg);
+        --routine->home->pending;
+        if ((timed_out(routine) || wait_cancelled(routine)) && task->abandon()) {
+            return;
+        }
+        delete task;
+    }
+};
+
+//run func(args...) on the await pool and suspend the calling routine until
+//it returns or deadline passes, which throws std::system_error(timed_out)
+//while the call finishes on the pool and its result is dropped. From the
+//main context there is nothing to switch to, func is called in place and the
+//deadline does not apply.
+template<typename Function, typename ... Args>
+decltype(auto) await_until(std::chrono::steady_clock::time_point deadline, Function&& func, Args&& ... args) {
+    using Call = AwaitCall<typename std::decay<Function>::type, typename std::decay<Args>::type...>;
+    using Task = AwaitTask<Call>;
+    Ordinator& ordinator = this_ordinator();
+    Routine *routine = ordinator.running;
+    if (routine == nullptr) {
+        Call call(std::forward<Function>(func), std::forward<Args>(args)...);
+        return call();
+    }
+
+    const bool timed = deadline != std::chrono::steady_clock::time_point::max();
+    //a throwing new or copy of the arguments must not leave the wait armed
+    std::unique_ptr<Task> task(new Task(routine, std::forward<Function>(func), std::forward<Args>(args)...));
+    const uint64_t epoch = begin_wait(routine);
+    task->epoch = epoch;
+    //routines of this thread come back through it, run() waits for them
+    Ordinator *home = routine->home;
+    if (home != nullptr) {
+        ++home->pending;
+        routine->leave = &Task::leave;
+        routine->leave_arg = task.get();
+    }
+    if (timed) {
+        add_timer(routine, deadline, epoch);
+    }
+    await_pool().submit(task.get());
+    suspend_wait(routine);
+    routine->leave = nullptr;
+
+    if (timed) {
+        cancel_timer(routine);
+    }
+    if (home != nullptr) {
+        --home->pending;
+    }
+    if ((timed_out(routine) || wait_cancelled(routine)) && task->abandon()) {
+        task.release();
+        check_cancelled(routine);
+        throw std::system_error(std::make_error_code(std::errc::timed_out), "await");
+    }
+    if (task->error) {
+        std::rethrow_exception(task->error);
+    }
+    return task->value.get();
+}
+
+template<typename Function, typename ... Args>
+decltype(auto) await(Function&& func, Args&& ... args) {
+    return await_until(std::chrono::steady_clock::time_point::max(), std::forward<Function>(func),
+                       std::forward<Args>(args)...);
+}
+
+template<typename Rep, typename Period, typename Function, typename ... Args>
+decltype(auto) await_for(const std::chrono::duration<Rep, Period>& timeout, Function&& func, Args&& ... args) {
+    return await_until(std::chrono::steady_clock::now()
+                       + std::chrono::duration_cast<std::chrono::steady_clock::duration>(timeout),
+                       std::forward<Function>(func), std::forward<Args>(args)...);
+}
+
+//an offload() call. The routine waits for it however long it takes, so it
+//can live in the routine's frame and needs none of AwaitTask's hand-off.
+template<typename Call>
+struct OffloadTask : PoolTask {
+    Call call;
+    AwaitValue<typename Call::Result> value;
+    std::exception_ptr error;
+    Routine *waiter;
+    //set by offload_wait() once the wait is armed
+    uint64_t epoch;
+
+    template<typename ... Params>
+    explicit OffloadTask(Routine *routine, Params&& ... params)
+        : call(std::forward<Params>(params)...)
+        , waiter(routine)
+        , epoch(0) {
+        run = &OffloadTask::complete;
+        next = nullptr;
+    }
+
+    static void complete(PoolTask *base) {
+        OffloadTask *task = static_cast<OffloadTask *>(base);
+        try {
+            task->value.set(task->call);
+        } catch (...) {
+            task->error = std::current_exception();
+        }
+        //the routine may return and drop the task as soon as it is claimed
+        Routine *waiter = task->waiter;
+        uint64_t epoch = task->epoch;
+        claim(waiter, epoch);
+    }
+
+    //the waiting routine was destroyed once the call returned, arg is the
+    //task if it is on the heap
+    static void leave(Routine *routine, void *arg) {
+        --routine->home->pending;
+        delete static_cast<OffloadTask *>(arg);
+    }
+};
+
+//owned: task is on the heap, not in the routine's frame
+template<typename Task>
+decltype(auto) offload_wait(ThreadPool& pool, Routine *routine, Task& task, bool owned) {
+    //the frame must outlive the call, so a cancel waits for it to return
+    task.epoch = begin_wait(routine, kWaitShielded);
+    Ordinator *home = routine->home;
+    if (home != nullptr) {
+        ++home->pending;
+        routine->leave = &Task::leave;
+        routine->leave_arg = owned ? &task : nullptr;
+    }
+    pool.submit(&task);
+    suspend_wait(routine);
+    routine->leave = nullptr;
+    if (home != nullptr) {
+        --home->pending;
+    }
+    if (task.error) {
+        std::rethrow_exception(task.error);
+    }
+    return task.value.get();
+}
+
+//run func(args...) on pool and park the calling routine until it returns,
+//it comes back through the thread (or Scheduler) it waited on. The call
+//sits in the routine's frame, a shared-stack routine's frame is copied
+//away while it waits so only there it goes to the heap. From the main
+//context func is called in place.
+template<typename Function, typename ... Args>
+decltype(auto) offload(ThreadPool& pool, Function&& func, Args&& ... args) {
+    using Call = AwaitCall<typename std::decay<Function>::type, typename std::decay<Args>::type...>;
+    using Task = OffloadTask<Call>;
+    Routine *routine = this_ordinator().running;
+    if (routine == nullptr) {
+        Call call(std::forward<Function>(func), std::forward<Args>(args)...);
+        return call();
+    }
+
+    //the task is built before the wait is armed, so a throwing new or copy
+    //of the arguments leaves no wait behind
+    if (routine->shared) {
+        std::unique_ptr<Task> task(new Task(routine, std::forward<Function>(func), std::forward<Args>(args)...));
+        return offload_wait(pool, routine, *task, true);
+    }
+    Task task(routine, std::forward<Function>(func), std::forward<Args>(args)...);
+    return offload_wait(pool, routine, task, false);
+}
+
+#ifdef COROUTINE_REACTOR
+
+//the routine waiting in wait_fd() was destroyed
+inline void leave_fd(Routine *routine, void *) {
+    routine->home->reactor->forget(routine);
+}
+
+//suspend the calling routine until fd is readable or writable, the thread's
+//run loop keeps serving other routines meanwhile. Scheduled routines and the
+//main context have no reactor to come back through and block in poll().
+//Returns 0, or -1 and errno; EBUSY if another routine of the thread already
+//waits for the same direction of fd.
+inline int wait_fd(int fd, bool write) {
+    Ordinator& ordinator = this_ordinator();
+    Routine *routine = ordinator.running;
+    if (routine == nullptr || routine->scheduler != nullptr) {
+        pollfd entry = { fd, short(write ? POLLOUT : POLLIN), 0 };
+        int result;
+        do {
+            result = ::poll(&entry, 1, -1);
+        } while (result < 0 && errno == EINTR);
+        return result < 0 ? -1 : 0;
+    }
+
+    if (!ordinator.reactor) {
+        ordinator.reactor.reset(new Reactor());
+    }
+    //the reactor is polled by this thread only, after the routine switched
+    //out, so the wait is armed once add() can no longer fail
+    if (ordinator.reactor->add(routine, fd, write) != 0) {
+        return -1;
+    }
+    routine->leave = &leave_fd;
+    begin_wait(routine);
+    suspend_wait(routine);
+    routine->leave = nullptr;
+    if (wait_cancelled(routine)) {
+        ordinator.reactor->remove(routine, fd, write);
+        throw_cancelled(routine);
+    }
+    return 0;
+}
+
+inline int wait_readable(int fd) {
+    return wait_fd(fd, false);
+}
+
+inline int wait_writable(int fd) {
+    return wait_fd(fd, true);
+}
+
+inline bool would_block(int error) {
+    return error == EAGAIN || error == EWOULDBLOCK;
+}
+
+//like ::read() on a non-blocking descriptor, but waits instead of EAGAIN
+inline ssize_t read(int fd, void *buffer, size_t size) {
+    for (;;) {
+        ssize_t n = ::read(fd, buffer, size);
+        if (n >= 0) {
+            return n;
+        }
+        if (errno == EINTR) {
+            continue;
+        }
+        if (!would_block(errno) || wait_fd(fd, false) != 0) {
+            return -1;
+        }
+    }
+}
+
+//like ::write(), may write less than size just like it
+inline ssize_t write(int fd, const void *buffer, size_t size) {
+    for (;;) {
+        ssize_t n = ::write(fd, buffer, size);
+        if (n >= 0) {
+            return n;
+        }
+        if (errno == EINTR) {
+            continue;
+        }
+        if (!would_block(errno) || wait_fd(fd, true) != 0) {
+            return -1;
+        }
+    }
+}
+
+//the accepted socket is non-blocking already, ready for read()/write()
+inline int accept(int fd, sockaddr *address, socklen_t *length) {
+    for (;;) {
+#ifdef __linux__
+        int client = ::accept4(fd, address, length, SOCK_NONBLOCK | SOCK_CLOEXEC);
+#else
+        int client = ::accept(fd, address, length);
+        if (client >= 0) {
+            fcntl(client, F_SETFL, fcntl(client, F_GETFL) | O_NONBLOCK);
+            fcntl(client, F_SETFD, FD_CLOEXEC);
+        }
+#endif
+        if (client >= 0) {
+            return client;
+        }
+        if (errno == EINTR || errno == ECONNABORTED) {
+            continue;
+        }
+        if (!would_block(errno) || wait_fd(fd, false) != 0) {
+            return -1;
+        }
+    }
+}
+
+//fd must be a non-blocking socket
+inline int connect(int fd, const sockaddr *address, socklen_t length) {
+    if (::connect(fd, address, length) == 0) {
+        return 0;
+    }
+    if (errno != EINPROGRESS && errno != EINTR) {
+        return -1;
+    }
+    if (wait_fd(fd, true) != 0) {
+        return -1;
+    }
+
+    int error = 0;
+    socklen_t size = sizeof(error);
+    if (getsockopt(fd, SOL_SOCKET, SO_ERROR, &error, &size) != 0) {
+        return -1;
+    }
+    if (error != 0) {
+        errno = error;
+        return -1;
+    }
+    return 0;
+}
+
+#endif
+
+//ring size of a Channel, rounded up to a power of two. A type of its own so
+//that no other integer, a routine_t say, is taken for one by accident.
+struct Capacity {
+    explicit Capacity(size_t count)
+        : value(count) {
+    }
+
+    size_t value;
+};
+
+//bounded multi-producer multi-consumer channel, usable from any thread and
+//any routine. Elements live in a ring of sequenced cells (Vyukov), so push()
+//and pop() take no lock and allocate nothing unless someone has to wait:
+//a pusher that finds the ring full, or a popper that finds it empty, blocks
+//in a waiter queue and is handed back by the other side.
+template<typename Type>
+class Channel {
+public:
+    explicit Channel(Capacity capacity = Capacity(CHANNEL_CAPACITY))
+        : enqueue_pos_(0)
+        , dequeue_pos_(0)
+#if COROUTINE_STATS
+        , high_water_(0)
+#endif
+    {
+        size_t size = 2;
+        while (size < capacity.value) {
+            size *= 2;
+        }
+        mask_ = size - 1;
+        cells_.reset(new Cell[size]);
+        for (size_t i = 0; i < size; ++i) {
+            cells_[i].sequence.store(i, std::memory_order_relaxed);
+        }
+        senders_.set_pass_on(this, &Channel::pass_on_waiter);
+        receivers_.set_pass_on(this, &Channel::pass_on_waiter);
+    }
+
+    ~Channel() {
+        size_t pos;
+        while (Cell *cell = take(pos)) {
+            cell->value()->~Type();
+        }
+    }
+
+    Channel(const Channel&) = delete;
+    Channel& operator=(const Channel&) = delete;
+
+    //waits while the channel is full
+    inline void push(const Type& obj) {
+        send(obj, std::chrono::steady_clock::time_point::max());
+    }
+
+    inline void push(Type&& obj) {
+        send(std::move(obj), std::chrono::steady_clock::time_point::max());
+    }
+
+    //false if the channel is full
+    inline bool try_push(const Type& obj) {
+        return offer(obj);
+    }
+
+    inline bool try_push(Type&& obj) {
+        return offer(std::move(obj));
+    }
+
+    //waits while the channel is empty
+    inline Type pop() {
+        size_t pos;
+        Cell *cell = receive(pos, std::chrono::steady_clock::time_point::max());
+        Type obj(std::move(*cell->value()));
+        release(cell, pos);
+        consumed(1);
+        return obj;
+    }
+
+    //false if the channel is empty
+    inline bool try_pop(Type& obj) {
+        size_t pos;
+        Cell *cell = take(pos);
+        if (cell == nullptr) {
+            return false;
+        }
+        obj = std::move(*cell->value());
+        release(cell, pos);
+        consumed(1);
+        return true;
+    }
+
+    //push count elements read from first, waiting for room as often as
+    //needed; waiting poppers are woken once per run of elements that fit,
+    //not once per element
+    template<typename InputIt>
+    void push_n(InputIt first, size_t count) {
+        while (count > 0) {
+            size_t pushed = 0;
+            while (pushed < count && enqueue(*first)) {
+                ++first;
+                ++pushed;
+            }
+            if (pushed > 0) {
+                count -= pushed;
+                hand_off();
+                continue;
+            }
+            std::unique_lock<std::mutex> lock(mutex_);
+            wait_in(senders_, lock, [this] { return writable(); });
+        }
+    }
+
+    //wait for at least one element, then move up to max of them to out,
+    //returns how many
+    template<typename OutputIt>
+    size_t pop_n(OutputIt out, size_t max) {
+        if (max == 0) {
+            return 0;
+        }
+        size_t pos;
+        Cell *cell = receive(pos, std::chrono::steady_clock::time_point::max());
+        *out = std::move(*cell->value());
+        ++out;
+        release(cell, pos);
+        size_t count = 1 + move_out(out, max - 1);
+        consumed(count);
+        return count;
+    }
+
+    //move up to max elements that are there right now to out, never waits
+    template<typename OutputIt>
+    size_t drain_into(OutputIt out, size_t max = SIZE_MAX) {
+        size_t count = move_out(out, max);
+        if (count > 0) {
+            consumed(count);
+        }
+        return count;
+    }
+
+    //pop() that gives up at deadline, false if nothing arrived by then
+    inline bool pop_until(Type& obj, std::chrono::steady_clock::time_point deadline) {
+        size_t pos;
+        Cell *cell = receive(pos, deadline);
+        if (cell == nullptr) {
+            return false;
+        }
+        obj = std::move(*cell->value());
+        release(cell, pos);
+        consumed(1);
+        return true;
+    }
+
+    template<typename Rep, typename Period>
+    bool pop_for(Type& obj, const std::chrono::duration<Rep, Period>& timeout) {
+        return pop_until(obj, std::chrono::steady_clock::now()
+                              + std::chrono::duration_cast<std::chrono::steady_clock::duration>(timeout));
+    }
+
+    //drop every element, waiting pushers get the room
+    inline void clear() {
+        size_t pos;
+        while (Cell *cell = take(pos)) {
+            release(cell, pos);
+        }
+        std::lock_guard<std::mutex> lock(mutex_);
+        signal_all(senders_);
+    }
+
+    //make waiting poppers look at the channel again
+    inline void touch() {
+        std::lock_guard<std::mutex> lock(mutex_);
+        signal_all(receivers_);
+    }
+
+    //a snapshot, may be stale as soon as it returns
+    inline size_t size() const {
+        size_t head = dequeue_pos_.load(std::memory_order_relaxed);
+        size_t tail = enqueue_pos_.load(std::memory_order_relaxed);
+        return tail > head ? tail - head : 0;
+    }
+
+    inline bool empty() const {
+        return size() == 0;
+    }
+
+    inline size_t capacity() const {
+        return mask_ + 1;
+    }
+
+#if COROUTINE_STATS
+    //most elements held at once, roughly: racing pushers may lose an update
+    inline size_t high_water() const {
+        return size_t(high_water_.load(std::memory_order_relaxed));
+    }
+#endif
+
+    //select(): link waiter as a pusher or popper, true if that side can go
+    //already. It stays linked until unwatch().
+    inline bool watch(Waiter *waiter, bool push) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        waiter->queue = push ? &senders_ : &receivers_;
+        waiter->lock = &mutex_;
+        waiter->queue->push_back(waiter);
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        return push ? writable() : readable();
+    }
+
+    inline void unwatch(Waiter *waiter, bool push) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        if (waiter->linked) {
+            (push ? senders_ : receivers_).remove(waiter);
+        }
+        waiter->queue = nullptr;
+    }
+
+    //give a wakeup a select() got from this channel but did not use to the
+    //next waiter, as the pushes or pops that sent it will not send another
+    inline void pass_on(bool push) {
+        if (push) {
+            notify(senders_);
+        } else {
+            hand_off();
+        }
+    }
+
+private:
+    struct Cell {
+        std::atomic<size_t> sequence;
+        typename std::aligned_storage<sizeof(Type), alignof(Type)>::type storage;
+
+        inline Type *value() {
+            return static_cast<Type *>(static_cast<void *>(&storage));
+        }
+    };
+
+    //a cell is free for position pos once its sequence is pos, and holds the
+    //element of pos once its sequence is pos + 1
+    template<typename Value>
+    inline bool enqueue(Value&& obj) {
+        size_t pos = enqueue_pos_.load(std::memory_order_relaxed);
+        Cell *cell;
+        for (;;) {
+            cell = &cells_[pos & mask_];
+            size_t sequence = cell->sequence.load(std::memory_order_acquire);
+            intptr_t diff = intptr_t(sequence) - intptr_t(pos);
+            if (diff == 0) {
+                if (enqueue_pos_.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+                    break;
+                }
+            } else if (diff < 0) {
+                return false;
+            } else {
+                pos = enqueue_pos_.load(std::memory_order_relaxed);
+            }
+        }
+        new (cell->value()) Type(std::forward<Value>(obj));
+        cell->sequence.store(pos + 1, std::memory_order_release);
+#if COROUTINE_STATS
+        int64_t depth = int64_t(pos + 1 - dequeue_pos_.load(std::memory_order_relaxed));
+        if (depth > high_water_.load(std::memory_order_relaxed)) {
+            high_water_.store(depth, std::memory_order_relaxed);
+            stat_max(this_ordinator().stats.channel_high_water, depth);
+        }
+#endif
+        return true;
+    }
+
+    //claim the oldest element, nullptr if there is none; the cell is reused
+    //once it is handed to release()
+    inline Cell *take(size_t& pos) {
+        pos = dequeue_pos_.load(std::memory_order_relaxed);
+        Cell *cell;
+        for (;;) {
+            cell = &cells_[pos & mask_];
+            size_t sequence = cell->sequence.load(std::memory_order_acquire);
+            intptr_t diff = intptr_t(sequence) - intptr_t(pos + 1);
+            if (diff == 0) {
+                if (dequeue_pos_.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+                    break;
+                }
+            } else if (diff < 0) {
+                return nullptr;
+            } else {
+                pos = dequeue_pos_.load(std::memory_order_relaxed);
+            }
+        }
+        return cell;
+    }
+
+    //the wakeup of a waiter destroy() took out goes on, an element handed to
+    //it is dropped as if it had popped it
+    static void pass_on_waiter(void *owner, WaitQueue& queue, Waiter *waiter) {
+        Channel *channel = static_cast<Channel *>(owner);
+        if (&queue == &channel->senders_) {
+            channel->notify(channel->senders_);
+        } else if (waiter->handoff != nullptr) {
+            channel->release(static_cast<Cell *>(waiter->handoff), waiter->handoff_pos);
+            channel->consumed(1);
+        } else {
+            channel->hand_off();
+        }
+    }
+
+    inline void release(Cell *cell, size_t pos) {
+        cell->value()->~Type();
+        cell->sequence.store(pos + mask_ + 1, std::memory_order_release);
+    }
+
+    template<typename OutputIt>
+    inline size_t move_out(OutputIt& out, size_t max) {
+        size_t count = 0;
+        size_t pos;
+        while (count < max) {
+            Cell *cell = take(pos);
+            if (cell == nullptr) {
+                break;
+            }
+            *out = std::move(*cell->value());
+            ++out;
+            release(cell, pos);
+            ++count;
+        }
+        return count;
+    }
+
+    //count cells became free: wake as many pushers. A batch of pushes wakes a
+    //single popper, which passes the wakeup on while elements are left.
+    inline void consumed(size_t count) {
+        notify(senders_, count);
+        if (receivers_.waiting() != 0 && readable()) {
+            hand_off();
+        }
+    }
+
+    //may say yes spuriously, never no while an element or a free cell is there
+    inline bool readable() const {
+        size_t pos = dequeue_pos_.load(std::memory_order_relaxed);
+        size_t sequence = cells_[pos & mask_].sequence.load(std::memory_order_acquire);
+        return intptr_t(sequence) - intptr_t(pos + 1) >= 0;
+    }
+
+    inline bool writable() const {
+        size_t pos = enqueue_pos_.load(std::memory_order_relaxed);
+        size_t sequence = cells_[pos & mask_].sequence.load(std::memory_order_acquire);
+        return intptr_t(sequence) - intptr_t(pos) >= 0;
+    }
+
+    //pairs with the fence in wait_in(): either the waiter sees the change or
+    //this sees the waiter
+    inline void notify(WaitQueue& queue, size_t count = 1) {
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        if (queue.waiting() == 0) {
+            return;
+        }
+        std::lock_guard<std::mutex> lock(mutex_);
+        while (count > 0 && signal_one(queue)) {
+            --count;
+        }
+    }
+
+    //wake the first waiting popper with the oldest element already taken
+    //for it, so it returns without looking at the ring again and nobody can
+    //take the element in between. select() waiters are only signalled, they
+    //may be woken by another channel meanwhile and then pass it on.
+    inline void hand_off() {
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        if (receivers_.waiting() == 0) {
+            return;
+        }
+        std::lock_guard<std::mutex> lock(mutex_);
+        while (Waiter *waiter = receivers_.front()) {
+            if (waiter->group != nullptr) {
+                receivers_.pop_front();
+                if (signal(waiter)) {
+                    return;
+                }
+                continue;
+            }
+            size_t pos;
+            Cell *cell = take(pos);
+            if (cell == nullptr) {
+                return;
+            }
+            receivers_.pop_front();
+            waiter->handoff = cell;
+            waiter->handoff_pos = pos;
+            //even if its deadline won, the waiter takes the element once it
+            //gets mutex_ back
+            signal(waiter);
+            return;
+        }
+    }
+
+    template<typename Value>
+    inline bool offer(Value&& obj) {
+        if (!enqueue(std::forward<Value>(obj))) {
+            return false;
+        }
+        hand_off();
+        return true;
+    }
+
+    //obj is only moved from once it is enqueued
+    template<typename Value>
+    bool send(Value&& obj, std::chrono::steady_clock::time_point deadline) {
+        for (;;) {
+            if (offer(std::forward<Value>(obj))) {
+                return true;
+            }
+            std::unique_lock<std::mutex> lock(mutex_);
+            if (!wait_in(senders_, lock, [this] { return writable(); }, deadline)) {
+                lock.unlock();
+                return offer(std::forward<Value>(obj));
+            }
+        }
+    }
+
+    //nullptr if deadline passed with the channel still empty
+    Cell *receive(size_t& pos, std::chrono::steady_clock::time_point deadline) {
+        Routine *routine = this_ordinator().running;
+        Waiter local;
+        Waiter *waiter = routine != nullptr ? &routine->waiter : &local;
+        for (;;) {
+            Cell *cell = take(pos);
+            if (cell != nullptr) {
+                return cell;
+            }
+            std::unique_lock<std::mutex> lock(mutex_);
+            waiter->handoff = nullptr;
+            bool signaled = wait_in(receivers_, lock, [this] { return readable(); }, deadline, local);
+            if (waiter->handoff != nullptr) {
+                pos = waiter->handoff_pos;
+                return static_cast<Cell *>(waiter->handoff);
+            }
+            if (!signaled) {
+                lock.unlock();
+                return take(pos);
+            }
+        }
+    }
+
+    std::unique_ptr<Cell[]> cells_;
+    size_t mask_;
+    std::atomic<size_t> enqueue_pos_;
+    std::atomic<size_t> dequeue_pos_;
+#if COROUTINE_STATS
+    std::atomic<int64_t> high_water_;
+#endif
+    //guards the waiter queues only
+    std::mutex mutex_;
+    WaitQueue senders_;
+    WaitQueue receivers_;
+};
+
+template<typename Type>
+struct PopCase {
+    Channel<Type> *channel;
+    Type *out;
+
+    inline bool attempt() {
+        return channel->try_pop(*out);
+    }
+
+    inline bool watch(Waiter *waiter) {
+        return channel->watch(waiter, false);
+    }
+
+    inline void unwatch(Waiter *waiter) {
+        channel->unwatch(waiter, false);
+    }
+
+    inline void pass_on() {
+        channel->pass_on(false);
+    }
+};
+
+template<typename Type>
+struct PushCase {
+    Channel<Type> *channel;
+    const Type *value;
+
+    inline bool attempt() {
+        return channel->try_push(*value);
+    }
+
+    inline bool watch(Waiter *waiter) {
+        return channel->watch(waiter, true);
+    }
+
+    inline void unwatch(Waiter *waiter) {
+        channel->unwatch(waiter, true);
+    }
+
+    inline void pass_on() {
+        channel->pass_on(true);
+    }
+};
+
+//select() case that pops into out
+template<typename Type>
+PopCase<Type> on_pop(Channel<Type>& channel, Type& out) {
+    return PopCase<Type>{ &channel, &out };
+}
+
+//select() case that pushes a copy of value
+template<typename Type>
+PushCase<Type> on_push(Channel<Type>& channel, const Type& value) {
+    return PushCase<Type>{ &channel, &value };
+}
+
+//type-erased case, so the waiting below is not instantiated per case list
+struct SelectCase {
+    void *target;
+    bool (*attempt)(void *);
+    bool (*watch)(void *, Waiter *);
+    void (*unwatch)(void *, Waiter *);
+    void (*pass_on)(void *);
+
+    template<typename Case>
+    static bool attempt_case(void *target) {
+        return static_cast<Case *>(target)->attempt();
+    }
+
+    template<typename Case>
+    static bool watch_case(void *target, Waiter *waiter) {
+        return static_cast<Case *>(target)->watch(waiter);
+    }
+
+    template<typename Case>
+    static void unwatch_case(void *target, Waiter *waiter) {
+        static_cast<Case *>(target)->unwatch(waiter);
+    }
+
+    template<typename Case>
+    static void pass_on_case(void *target) {
+        static_cast<Case *>(target)->pass_on();
+    }
+};
+
+template<typename Case>
+SelectCase select_case(Case& target) {
+    return SelectCase{ &target, &SelectCase::attempt_case<Case>, &SelectCase::watch_case<Case>,
+                       &SelectCase::unwatch_case<Case>, &SelectCase::pass_on_case<Case> };
+}
+
+//complete the first of count cases that can go, waiting in all of their
+//channels at once until one can or deadline passes; returns its index, -1
+//on timeout
+inline int select_cases(SelectCase *cases, size_t count, std::chrono::steady_clock::time_point deadline) {
+    assert(count > 0);
+    Ordinator& ordinator = this_ordinator();
+    Routine *routine = ordinator.running;
+    //start at another case every time so a busy one does not starve the rest
+    const size_t start = ordinator.select_turn++ % count;
+    const bool timed = deadline != std::chrono::steady_clock::time_point::max();
+
+    //waiters of a routine live in its block, the stack may be copied away
+    std::unique_ptr<Waiter[]> local;
+    Waiter *waiters;
+    if (routine != nullptr) {
+        if (routine->select_capacity < count) {
+            routine->select_waiters.reset(new Waiter[count]);
+            routine->select_capacity = count;
+        }
+        waiters = routine->select_waiters.get();
+    } else {
+        local.reset(new Waiter[count]);
+        waiters = local.get();
+    }
+
+    //case whose channel woke the last wait, passed on unless it is the one
+    //that completes
+    SelectCase *woken = nullptr;
+    for (;;) {
+        for (size_t i = 0; i < count; ++i) {
+            size_t index = (start + i) % count;
+            if (cases[index].attempt(cases[index].target)) {
+                if (woken != nullptr && woken != &cases[index]) {
+                    woken->pass_on(woken->target);
+                }
+                return int(index);
+            }
+        }
+        if (timed && std::chrono::steady_clock::now() >= deadline) {
+            if (woken != nullptr) {
+                woken->pass_on(woken->target);
+            }
+            return -1;
+        }
+
+        const uint64_t epoch = routine != nullptr ? begin_wait(routine) : 0;
+        for (size_t i = 0; i < count; ++i) {
+            Waiter& waiter = waiters[i];
+            waiter.routine = routine;
+            waiter.home = routine != nullptr ? routine->home : &ordinator;
+            waiter.epoch = epoch;
+            waiter.group = &waiters[0];
+            waiter.woken = nullptr;
+            waiter.signaled = false;
+        }
+
+        size_t armed = 0;
+        bool ready = false;
+        while (armed < count && !ready) {
+            ready = cases[armed].watch(cases[armed].target, &waiters[armed]);
+            ++armed;
+        }
+
+        if (!ready) {
+            if (routine != nullptr) {
+                Ordinator *home = routine->home;
+                if (home != nullptr) {
+                    ++home->pending;
+                }
+                if (timed) {
+                    add_timer(routine, deadline, epoch);
+                }
+                suspend_wait(routine);
+                if (timed) {
+                    cancel_timer(routine);
+                }
+                if (home != nullptr) {
+                    --home->pending;
+                }
+            } else {
+                drive(ordinator, [waiters] {
+                    return waiters[0].signaled;
+                }, deadline, true);
+            }
+        }
+
+        for (size_t i = 0; i < armed; ++i) {
+            cases[i].unwatch(cases[i].target, &waiters[i]);
+        }
+        //a wait ended by cancel() got no wakeup to pass on
+        check_cancelled(routine);
+        woken = waiters[0].woken != nullptr ? &cases[waiters[0].woken - waiters] : nullptr;
+    }
+}
+
+template<typename ... Cases>
+int select_until(std::chrono::steady_clock::time_point deadline, Cases&& ... cases) {
+    SelectCase list[] = { select_case(cases)... };
+    return select_cases(list, sizeof...(Cases), deadline);
+}
+
+template<typename Rep, typename Period, typename ... Cases>
+int select_for(const std::chrono::duration<Rep, Period>& timeout, Cases&& ... cases) {
+    return select_until(std::chrono::steady_clock::now()
+                        + std::chrono::duration_cast<std::chrono::steady_clock::duration>(timeout),
+                        std::forward<Cases>(cases)...);
+}
+
+//select_until() without a deadline
+template<typename ... Cases>
+int select(Cases&& ... cases) {
+    return select_until(std::chrono::steady_clock::time_point::max(), std::forward<Cases>(cases)...);
+}
+
+//completion of a routine started by async(), lives in its routine block
+struct FutureBase {
+    bool done;
+    //routine parked on this future until done, see join(); only one at a
+    //time, a second is refused. A handle, it may be destroyed meanwhile.
+    routine_t joiner;
+
+    FutureBase()
+        : done(false)
+        , joiner(0) {
+    }
+
+    inline void complete() {
+        done = true;
+        Routine *routine = joiner != 0 ? lookup(this_ordinator(), joiner) : nullptr;
+        joiner = 0;
+        if (routine != nullptr && routine->join_pending > 0 && --routine->join_pending == 0) {
+            wake(routine);
+        }
+    }
+};
+
+template<typename Result>
+struct FutureState : FutureBase {
+    AwaitValue<Result> value;
+    std::exception_ptr error;
+};
+
+template<typename Call>
+struct FutureCall {
+    Call call;
+    FutureState<typename Call::Result> state;
+
+    explicit FutureCall(Call&& task)
+        : call(std::move(task)) {
+    }
+
+    inline void operator()() {
+        try {
+            state.value.set(call);
+        } catch (const Cancelled&) {
+            state.error = std::make_exception_ptr(FutureCancelled());
+        } catch (...) {
+            state.error = std::current_exception();
+        }
+        state.complete();
+    }
+};
+
+inline size_t done_count(FutureBase *const *states, size_t count) {
+    size_t done = 0;
+    for (size_t i = 0; i < count; ++i) {
+        done += states[i]->done ? 1 : 0;
+    }
+    return done;
+}
+
+//wait until needed of the count states are done, parking the calling routine
+//once and waking it only when the last of them completes. From the main
+//context the run loop is driven instead.
+inline void unjoin(Routine *routine, FutureBase *const *states, size_t count) {
+    routine->join_pending = 0;
+    for (size_t i = 0; i < count; ++i) {
+        if (states[i]->joiner == routine->id) {
+            states[i]->joiner = 0;
+        }
+    }
+}
+
+inline void join(FutureBase *const *states, size_t count, size_t needed) {
+    Ordinator& ordinator = this_ordinator();
+    Routine *routine = ordinator.running;
+    if (routine == nullptr) {
+        drive(ordinator, [states, count, needed] {
+            return done_count(states, count) >= needed;
+        });
+        assert(done_count(states, count) >= needed);
+        return;
+    }
+    assert(routine->scheduler == nullptr);
+    for (size_t i = 0; i < count; ++i) {
+        const routine_t joiner = states[i]->joiner;
+        if (!states[i]->done && joiner != 0 && joiner != routine->id && lookup(ordinator, joiner) != nullptr) {
+            throw std::system_error(std::make_error_code(std::errc::device_or_resource_busy),
+                                    "future has a joiner");
+        }
+    }
+
+    for (;;) {
+        size_t done = done_count(states, count);
+        if (done >= needed) {
+            break;
+        }
+        routine->join_pending = needed - done;
+        for (size_t i = 0; i < count; ++i) {
+            if (!states[i]->done) {
+                states[i]->joiner = routine->id;
+            }
+        }
+        try {
+            park();
+        } catch (...) {
+            unjoin(routine, states, count);
+            throw;
+        }
+    }
+    unjoin(routine, states, count);
+}
+
+//result of a routine started by async(). The routine block keeps the result,
+//so it stays allocated until the future is gone; a future dropped early lets
+//the run loop destroy the routine once it finishes. Futures belong to the
+//thread that made them.
+template<typename Result>
+class Future {
+public:
+    Future()
+        : id_(0)
+        , state_(nullptr) {
+    }
+
+    Future(routine_t id, FutureState<Result> *state)
+        : id_(id)
+        , state_(state) {
+    }
+
+    Future(Future&& other) noexcept
+        : id_(other.id_)
+        , state_(other.state_) {
+        other.id_ = 0;
+        other.state_ = nullptr;
+    }
+
+    Future& operator=(Future&& other) noexcept {
+        if (this != &other) {
+            release();
+            id_ = other.id_;
+            state_ = other.state_;
+            other.id_ = 0;
+            other.state_ = nullptr;
+        }
+        return *this;
+    }
+
+    ~Future() {
+        release();
+    }
+
+    Future(const Future&) = delete;
+    Future& operator=(const Future&) = delete;
+
+    inline bool valid() const {
+        return state_ != nullptr;
+    }
+
+    inline bool ready() const {
+        return state_->done;
+    }
+
+    //park until the routine finished
+    inline void wait() {
+        FutureBase *state = state_;
+        join(&state, 1, 1);
+    }
+
+    //wait, then hand out the value or rethrow the exception, only once
+    inline decltype(auto) get() {
+        wait();
+        if (state_->error) {
+            std::rethrow_exception(state_->error);
+        }
+        return state_->value.get();
+    }
+
+    inline FutureBase *state() const {
+        return state_;
+    }
+
+private:
+    inline void release() {
+        if (state_ == nullptr) {
+            return;
+        }
+        Ordinator& ordinator = this_ordinator();
+        Routine *routine = lookup(ordinator, id_);
+        if (routine != nullptr) {
+            if (routine->finished) {
+                destroy(ordinator, routine);
+            } else {
+                routine->detached = true;
+            }
+        }
+        id_ = 0;
+        state_ = nullptr;
+    }
+
+    routine_t id_;
+    FutureState<Result> *state_;
+};
+
+//run func(args...) in a new routine of the calling thread's run loop, the
+//arguments are copied like std::async does
+template<typename Function, typename ... Args>
+auto async(Function&& func, Args&& ... args) {
+    using Call = AwaitCall<typename std::decay<Function>::type, typename std::decay<Args>::type...>;
+    using Result = typename Call::Result;
+    Ordinator& ordinator = this_ordinator();
+    assert(ordinator.scheduler == nullptr);
+    routine_t id = create(FutureCall<Call>(Call(std::forward<Function>(func), std::forward<Args>(args)...)));
+    Routine *routine = lookup(ordinator, id);
+    enqueue(ordinator, routine);
+    return Future<Result>(id, &routine->target<FutureCall<Call>>()->state);
+}
+
+//park once until every future is ready
+template<typename ... Results>
+void when_all(Future<Results>& ... futures) {
+    FutureBase *states[] = { futures.state()... };
+    join(states, sizeof...(Results), sizeof...(Results));
+}
+
+template<typename Result>
+void when_all(std::vector<Future<Result>>& futures) {
+    std::vector<FutureBase *> states;
+    states.reserve(futures.size());
+    for (Future<Result>& future : futures) {
+        states.push_back(future.state());
+    }
+    join(states.data(), states.size(), states.size());
+}
+
+//park once until one of the futures is ready, returns the index of the
+//first ready one
+template<typename ... Results>
+size_t when_any(Future<Results>& ... futures) {
+    FutureBase *states[] = { futures.state()... };
+    join(states, sizeof...(Results), 1);
+    size_t index = 0;
+    while (!states[index]->done) {
+        ++index;
+    }
+    return index;
+}
+
+template<typename Result>
+size_t when_any(std::vector<Future<Result>>& futures) {
+    assert(!futures.empty());
+    std::vector<FutureBase *> states;
+    states.reserve(futures.size());
+    for (Future<Result>& future : futures) {
+        states.push_back(future.state());
+    }
+    join(states.data(), states.size(), 1);
+    size_t index = 0;
+    while (!states[index]->done) {
+        ++index;
+    }
+    return index;
+}
+
+//the generator's end of a Generator, its body hands values out through it.
+//A value stays where the body keeps it, the consumer gets a pointer to it
+//until it asks for the next one.
+template<typename Type>
+class Yield {
+public:
+    Yield()
+        : routine_(nullptr)
+        , value_(nullptr)
+        , stop_(false) {
+    }
+
+    Yield(const Yield&) = delete;
+    Yield& operator=(const Yield&) = delete;
+
+    //switch back to the consumer with value, returns when it wants the next.
+    //Throws Cancelled when the Generator is dropped, so the body unwinds, and
+    //again on every later call until it does.
+    inline void yield_value(Type&& value) {
+        value_ = &value;
+        unpull(routine_);
+        value_ = nullptr;
+        if (stop_) {
+            throw Cancelled();
+        }
+    }
+
+    //copied on the generator's stack, move values in to skip the copy
+    inline void yield_value(const Type& value) {
+        Type copy(value);
+        yield_value(std::move(copy));
+    }
+
+    inline void operator()(Type&& value) {
+        yield_value(std::move(value));
+    }
+
+    inline void operator()(const Type& value) {
+        yield_value(value);
+    }
+
+private:
+    template<typename> friend class Generator;
+    template<typename, typename> friend struct GeneratorCall;
+
+    Routine *routine_;
+    Type *value_;
+    bool stop_;
+    std::exception_ptr error_;
+};
+
+//body of a Generator, kept in its routine block next to the Yield
+template<typename Type, typename Function>
+struct GeneratorCall {
+    Function func;
+    Yield<Type> yield;
+
+    explicit GeneratorCall(Function&& body)
+        : func(std::move(body)) {
+    }
+
+    //moved into the routine block before it first runs, the Yield is fresh
+    GeneratorCall(GeneratorCall&& other)
+        : func(std::move(other.func)) {
+    }
+
+    inline void operator()() {
+        try {
+            func(yield);
+        } catch (...) {
+            if (!yield.stop_) {
+                yield.error_ = std::current_exception();
+            }
+        }
+    }
+};
+
+//lazy sequence produced by func(Yield<Type>&) in a routine of its own, which
+//runs only while the consumer waits for its next value: one switch there and
+//one back per value, and nothing allocated after the first. The body must not
+//wait or yield() otherwise. Generators belong to the thread that made them and
+//are pulled from its main context or its run loop's routines; one dropped
+//before its end unwinds its body at the pending yield_value(), which must
+//not swallow that Cancelled for good.
+template<typename Type>
+class Generator {
+public:
+    class iterator {
+    public:
+        using iterator_category = std::input_iterator_tag;
+        using value_type = Type;
+        using difference_type = std::ptrdiff_t;
+        using pointer = Type *;
+        using reference = Type&;
+
+        iterator()
+            : generator_(nullptr) {
+        }
+
+        explicit iterator(Generator *generator)
+            : generator_(generator) {
+        }
+
+        inline Type& operator*() const {
+            return *generator_->yield_->value_;
+        }
+
+        inline Type *operator->() const {
+            return generator_->yield_->value_;
+        }
+
+        inline iterator& operator++() {
+            if (!generator_->advance()) {
+                generator_ = nullptr;
+            }
+            return *this;
+        }
+
+        inline void operator++(int) {
+            ++*this;
+        }
+
+        inline bool operator==(const iterator& other) const {
+            return generator_ == other.generator_;
+        }
+
+        inline bool operator!=(const iterator& other) const {
+            return generator_ != other.generator_;
+        }
+
+    private:
+        Generator *generator_;
+    };
+
+    Generator()
+        : yield_(nullptr) {
+    }
+
+    //private stack only, a shared one can not be switched to from a routine
+    template<typename Function>
+    explicit Generator(Function&& func, const RoutineOptions& options = RoutineOptions())
+        : yield_(nullptr) {
+        using Call = GeneratorCall<Type, typename std::decay<Function>::type>;
+        RoutineOptions own = options;
+        own.shared_stack = false;
+        Ordinator& ordinator = this_ordinator();
+        Routine *routine = lookup(ordinator, create(Call(std::forward<Function>(func)), own));
+        yield_ = &routine->target<Call>()->yield;
+        yield_->routine_ = routine;
+    }
+
+    Generator(Generator&& other) noexcept
+        : yield_(other.yield_) {
+        other.yield_ = nullptr;
+    }
+
+    Generator& operator=(Generator&& other) noexcept {
+        if (this != &other) {
+            release();
+            yield_ = other.yield_;
+            other.yield_ = nullptr;
+        }
+        return *this;
+    }
+
+    ~Generator() {
+        release();
+    }
+
+    Generator(const Generator&) = delete;
+    Generator& operator=(const Generator&) = delete;
+
+    inline bool valid() const {
+        return yield_ != nullptr;
+    }
+
+    //runs the body to its next value
+    inline iterator begin() {
+        return advance() ? iterator(this) : iterator();
+    }
+
+    inline iterator end() {
+        return iterator();
+    }
+
+    //move the next value out, false once the body returned
+    inline bool next(Type& value) {
+        if (!advance()) {
+            return false;
+        }
+        value = std::move(*yield_->value_);
+        return true;
+    }
+
+private:
+    //false once the body returned, rethrows what escaped it
+    inline bool advance() {
+        Routine *routine = yield_->routine_;
+        if (routine->finished) {
+            return false;
+        }
+        pull(routine);
+        if (yield_->error_) {
+            std::exception_ptr error = yield_->error_;
+            yield_->error_ = nullptr;
+            std::rethrow_exception(error);
+        }
+        //a null value without the end means the body waited
+        assert(routine->finished || yield_->value_ != nullptr);
+        return !routine->finished;
+    }
+
+    inline void release() {
+        if (yield_ == nullptr) {
+            return;
+        }
+        Routine *routine = yield_->routine_;
+        if (!routine->finished && has_stack(routine)) {
+            //every yield_value() throws from now on, a body that catches
+            //Cancelled and yields again is pulled until it gives up
+            yield_->stop_ = true;
+            while (!routine->finished) {
+                pull(routine);
+            }
+        }
+        destroy(this_ordinator(), routine);
+        yield_ = nullptr;
+    }
+
+    Yield<Type> *yield_;
+};
+
+#ifdef COROUTINE_TASK
+
+template<typename Type>
+class Task;
+
+struct TaskPromiseBase {
+    //frame that co_awaits this task, resumed when it finishes
+    std::coroutine_handle<> continuation;
+    std::exception_ptr error;
+
+    struct FinalAwaiter {
+        inline bool await_ready() const noexcept {
+            return false;
+        }
+
+        template<typename Promise>
+        inline std::coroutine_handle<> await_suspend(std::coroutine_handle<Promise> handle) noexcept {
+            std::coroutine_handle<> continuation = handle.promise().continuation;
+            return continuation ? continuation : std::noop_coroutine();
+        }
+
+        inline void await_resume() const noexcept {
+        }
+    };
+
+    //tasks are lazy, nothing runs until they are awaited or get() is called
+    inline std::suspend_always initial_suspend() const noexcept {
+        return {};
+    }
+
+    inline FinalAwaiter final_suspend() const noexcept {
+        return {};
+    }
+
+    inline void unhandled_exception() {
+        error = std::current_exception();
+    }
+};
+
+template<typename Type>
+struct TaskPromise : TaskPromiseBase {
+    AwaitValue<Type> value;
+
+    inline Task<Type> get_return_object();
+
+    template<typename Value>
+    inline void return_value(Value&& result) {
+        auto call = [&result]() -> Type {
+            return std::forward<Value>(result);
+        };
+        value.set(call);
+    }
+};
+
+template<>
+struct TaskPromise<void> : TaskPromiseBase {
+    AwaitValue<void> value;
+
+    inline Task<void> get_return_object();
+
+    inline void return_void() {
+    }
+};
+
+//stackless coroutine returning Type. A frame is only as big as the locals
+//that live across its co_awaits. co_await on a Task transfers straight into
+//it and back. co_await on a Channel or on awaitable() blocks the routine (or
+//thread) that drives the chain, so the frames need no executor of their own
+//and every stackful call keeps working inside a task.
+template<typename Type>
+class Task {
+public:
+    using promise_type = TaskPromise<Type>;
+
+    explicit Task(std::coroutine_handle<promise_type> handle)
+        : handle_(handle) {
+    }
+
+    Task(Task&& other) noexcept
+        : handle_(std::exchange(other.handle_, nullptr)) {
+    }
+
+    Task& operator=(Task&& other) noexcept {
+        if (this != &other) {
+            if (handle_) {
+                handle_.destroy();
+            }
+            handle_ = std::exchange(other.handle_, nullptr);
+        }
+        return *this;
+    }
+
+    ~Task() {
+        if (handle_) {
+            handle_.destroy();
+        }
+    }
+
+    Task(const Task&) = delete;
+    Task& operator=(const Task&) = delete;
+
+    inline bool await_ready() const noexcept {
+        return false;
+    }
+
+    inline std::coroutine_handle<> await_suspend(std::coroutine_handle<> caller) noexcept {
+        handle_.promise().continuation = caller;
+        return handle_;
+    }
+
+    inline decltype(auto) await_resume() {
+        return result();
+    }
+
+    //run the task to completion on the calling routine's stack and return
+    //its value, this is how stackful code calls into stackless code
+    inline decltype(auto) get() {
+        assert(handle_ && !handle_.done());
+        handle_.resume();
+        //only awaiters from outside this header can leave a frame suspended
+        assert(handle_.done());
+        return result();
+    }
+
+private:
+    inline decltype(auto) result() {
+        promise_type& promise = handle_.promise();
+        if (promise.error) {
+            std::rethrow_exception(promise.error);
+        }
+        return promise.value.get();
+    }
+
+    std::coroutine_handle<promise_type> handle_;
+};
+
+template<typename Type>
+inline Task<Type> TaskPromise<Type>::get_return_object() {
+    return Task<Type>(std::coroutine_handle<TaskPromise>::from_promise(*this));
+}
+
+inline Task<void> TaskPromise<void>::get_return_object() {
+    return Task<void>(std::coroutine_handle<TaskPromise>::from_promise(*this));
+}
+
+template<typename Type>
+struct PopAwaiter {
+    Channel<Type> *channel;
+
+    inline bool await_ready() const noexcept {
+        return true;
+    }
+
+    inline void await_suspend(std::coroutine_handle<>) const noexcept {
+    }
+
+    inline Type await_resume() {
+        return channel->pop();
+    }
+};
+
+//co_await channel is channel.pop()
+template<typename Type>
+PopAwaiter<Type> operator co_await(Channel<Type>& channel) {
+    return PopAwaiter<Type>{ &channel };
+}
+
+template<typename Call>
+struct CallAwaiter {
+    Call call;
+
+    inline bool await_ready() const noexcept {
+        return true;
+    }
+
+    inline void await_suspend(std::coroutine_handle<>) const noexcept {
+    }
+
+    inline decltype(auto) await_resume() {
+        return await(std::move(call));
+    }
+};
+
+//co_await awaitable(func, args...) is await(func, args...)
+template<typename Function, typename ... Args>
+auto awaitable(Function&& func, Args&& ... args) {
+    using Call = AwaitCall<typename std::decay<Function>::type, typename std::decay<Args>::type...>;
+    return CallAwaiter<Call>{ Call(std::forward<Function>(func), std::forward<Args>(args)...) };
+}
+
+#endif //COROUTINE_TASK
+
 }
 #endif //STDEX_COROUTINE_H_
@@ -0,0 +1,226 @@
+//cancel()/CancelToken and timeout regressions
+//g++ -std=c++14 -O2 -I.. cancel.cpp -o cancel -lpthread && ./cancel
+#include "coroutine.h"
+#include "check.h"
+#include <atomic>
+#include <cstdio>
+#include <functional>
+#include <mutex>
+#include <system_error>
+#include <thread>
+#include <vector>
+
+using Clock = std::chrono::steady_clock;
+using std::chrono::milliseconds;
+
+//counts frames the Cancelled exception unwound
+struct Guard {
+    int *unwound;
+
+    ~Guard() {
+        ++*unwound;
+    }
+};
+
+//every cancellation point a routine of the thread may be suspended in
+//throws Cancelled in it, unwinding its frame
+static void cancel_unwinds_each_wait() {
+    coroutine::Channel<int> channel(coroutine::Capacity(2));
+    coroutine::Mutex held, mutex;
+    coroutine::CondVar ready;
+    coroutine::Semaphore semaphore;
+    coroutine::Future<int> never = coroutine::async([&channel] {
+        return channel.pop();
+    });
+    int unwound = 0;
+    int cancelled = 0;
+    std::vector<coroutine::routine_t> routines;
+    auto spawn = [&](std::function<void()> wait) {
+        routines.push_back(coroutine::spawn([&unwound, &cancelled, wait] {
+            Guard guard{ &unwound };
+            try {
+                wait();
+            } catch (const coroutine::Cancelled&) {
+                ++cancelled;
+                throw;
+            }
+            CHECK(false);
+        }));
+    };
+    spawn([] { coroutine::park(); });
+    spawn([] { coroutine::sleep_for(std::chrono::seconds(10)); });
+    spawn([&channel] { channel.pop(); });
+    spawn([&channel] {
+        int value;
+        coroutine::select(coroutine::on_pop(channel, value));
+    });
+    spawn([&held] { std::lock_guard<coroutine::Mutex> lock(held); });
+    spawn([&semaphore] { semaphore.acquire(); });
+    spawn([&mutex, &ready] {
+        std::unique_lock<coroutine::Mutex> lock(mutex);
+        ready.wait(lock);
+    });
+    spawn([&never] { never.get(); });
+    spawn([] {
+        coroutine::await([] {
+            std::this_thread::sleep_for(milliseconds(20));
+        });
+    });
+
+    held.lock();
+    coroutine::spawn([&] {
+        for (coroutine::routine_t id : routines) {
+            CHECK(coroutine::cancel(id) == 0);
+        }
+        channel.push(1);
+    });
+    Clock::time_point start = Clock::now();
+    coroutine::run();
+    held.unlock();
+    CHECK(cancelled == int(routines.size()) && unwound == int(routines.size()));
+    CHECK(Clock::now() - start < std::chrono::seconds(5));
+    CHECK(never.get() == 1);
+}
+
+//a cancel that comes while the routine runs ends its next wait, and
+//cancelled() sees it in between
+static void cancel_before_wait() {
+    bool seen = false, thrown = false;
+    coroutine::routine_t id = coroutine::spawn([&] {
+        coroutine::cancel(coroutine::current());
+        seen = coroutine::cancelled();
+        try {
+            coroutine::sleep_for(std::chrono::seconds(10));
+        } catch (const coroutine::Cancelled&) {
+            thrown = true;
+        }
+        CHECK(!coroutine::cancelled());
+    });
+    coroutine::run();
+    CHECK(seen && thrown);
+    CHECK(coroutine::cancel(id) == -1);
+}
+
+//an element handed over before the cancel is returned, the cancel stays
+//for the next wait
+static void handed_value_wins() {
+    coroutine::Channel<int> channel(coroutine::Capacity(2));
+    int got = -1;
+    bool thrown = false;
+    coroutine::routine_t popper = coroutine::spawn([&] {
+        got = channel.pop();
+        try {
+            channel.pop();
+        } catch (const coroutine::Cancelled&) {
+            thrown = true;
+        }
+    });
+    coroutine::resume(popper);
+    channel.push(8);
+    coroutine::cancel(popper);
+    coroutine::run();
+    CHECK(got == 8 && thrown);
+}
+
+//offload() is shielded: the call runs to its end and returns its value,
+//the cancel ends the wait after it
+static void offload_shielded() {
+    bool called = false, thrown = false;
+    int result = 0;
+    coroutine::routine_t id = coroutine::spawn([&] {
+        result = coroutine::offload(coroutine::cpu_pool(), [&called] {
+            std::this_thread::sleep_for(milliseconds(20));
+            called = true;
+            return 5;
+        });
+        try {
+            coroutine::park();
+        } catch (const coroutine::Cancelled&) {
+            thrown = true;
+        }
+    });
+    coroutine::resume(id);
+    coroutine::cancel(id);
+    coroutine::run();
+    CHECK(called && result == 5 && thrown);
+}
+
+//a token cancels routines parked on scheduler workers from another thread,
+//and routines that join it afterwards start cancelled
+static void token_across_workers() {
+    coroutine::CancelToken token;
+    coroutine::RoutineOptions options;
+    options.token = &token;
+    coroutine::Channel<int> channel(coroutine::Capacity(2));
+    std::atomic<int> cancelled(0);
+    std::atomic<int> started(0);
+    {
+        coroutine::Scheduler scheduler(2);
+        for (int i = 0; i < 32; ++i) {
+            scheduler.spawn([&] {
+                ++started;
+                try {
+                    channel.pop();
+                } catch (const coroutine::Cancelled&) {
+                    ++cancelled;
+                }
+            }, options);
+        }
+        while (started < 32) {
+            std::this_thread::yield();
+        }
+        std::thread([&token] { token.cancel(); }).join();
+        scheduler.spawn([&] {
+            try {
+                coroutine::yield();
+                channel.pop();
+            } catch (const coroutine::Cancelled&) {
+                ++cancelled;
+            }
+        }, options);
+        scheduler.wait();
+    }
+    CHECK(cancelled == 33 && channel.empty());
+}
+
+//await_for() gives up at its deadline with timed_out while the call goes
+//on to its end on the pool; a call in time returns its value
+static void await_timeout() {
+    std::atomic<bool> finished(false);
+    bool timed = false;
+    int value = 0;
+    Clock::duration waited;
+    coroutine::spawn([&] {
+        Clock::time_point start = Clock::now();
+        try {
+            coroutine::await_for(milliseconds(20), [&finished] {
+                std::this_thread::sleep_for(milliseconds(200));
+                finished = true;
+            });
+        } catch (const std::system_error& error) {
+            timed = error.code() == std::errc::timed_out;
+        }
+        waited = Clock::now() - start;
+        value = coroutine::await_for(std::chrono::seconds(10), [] {
+            return 2;
+        });
+    });
+    coroutine::run();
+    CHECK(timed && waited >= milliseconds(20) && waited < milliseconds(200));
+    CHECK(value == 2);
+    for (int i = 0; i < 1000 && !finished; ++i) {
+        std::this_thread::sleep_for(milliseconds(1));
+    }
+    CHECK(finished);
+}
+
+int main() {
+    cancel_unwinds_each_wait();
+    cancel_before_wait();
+    handed_value_wins();
+    offload_shielded();
+    token_across_workers();
+    await_timeout();
+    std::printf("cancel ok\n");
+    return 0;
+}
@@ -0,0 +1,68 @@
+//Channel regressions
+//g++ -std=c++14 -O2 -I.. channel.cpp -o channel -lpthread && ./channel
+#include "coroutine.h"
+#include "check.h"
+#include <cstdio>
+#include <thread>
+#include <type_traits>
+#include <vector>
+
+using Clock = std::chrono::steady_clock;
+using std::chrono::milliseconds;
+
+//a routine_t, or any other integer, is not taken for a capacity
+static_assert(!std::is_constructible<coroutine::Channel<int>, coroutine::routine_t>::value,
+              "Channel built from an integer");
+static_assert(!std::is_constructible<coroutine::Channel<int>, int>::value, "Channel built from an integer");
+
+//the main context pushes far more than fit into a channel whose only
+//consumer is a routine of the same thread, which runs while it waits
+static void main_push_into_full_channel() {
+    coroutine::Channel<int> channel(coroutine::Capacity(2));
+    std::vector<int> got;
+    coroutine::spawn([&] {
+        for (int i = 0; i < 100; ++i) {
+            got.push_back(channel.pop());
+        }
+    });
+    for (int i = 0; i < 100; ++i) {
+        channel.push(i);
+    }
+    coroutine::run();
+    CHECK(got.size() == 100 && got[0] == 0 && got[99] == 99);
+}
+
+//and pops what a sleeping routine of its thread pushes later
+static void main_pop_from_sleeping_producer() {
+    coroutine::Channel<int> channel(coroutine::Capacity(2));
+    coroutine::spawn([&channel] {
+        coroutine::sleep_for(milliseconds(10));
+        channel.push(3);
+    });
+    CHECK(channel.pop() == 3);
+    coroutine::run();
+}
+
+//a timed pop from the main context still times out with nobody to push,
+//and still gets what another thread pushes
+static void main_pop_for() {
+    coroutine::Channel<int> channel(coroutine::Capacity(2));
+    int value = 0;
+    Clock::time_point start = Clock::now();
+    CHECK(!channel.pop_for(value, milliseconds(20)));
+    CHECK(Clock::now() - start >= milliseconds(20));
+    std::thread pusher([&channel] {
+        std::this_thread::sleep_for(milliseconds(20));
+        channel.push(9);
+    });
+    CHECK(channel.pop_for(value, std::chrono::seconds(10)) && value == 9);
+    pusher.join();
+}
+
+int main() {
+    main_push_into_full_channel();
+    main_pop_from_sleeping_producer();
+    main_pop_for();
+    std::printf("channel ok\n");
+    return 0;
+}
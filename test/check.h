@@ -0,0 +1,16 @@
+//assert() that stays on under NDEBUG, the tests are built both ways
+#ifndef COROUTINE_TEST_CHECK_H
+#define COROUTINE_TEST_CHECK_H
+
+#include <cstdio>
+#include <cstdlib>
+
+#define CHECK(condition)                                                                    \
+    do {                                                                                    \
+        if (!(condition)) {                                                                 \
+            std::fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, #condition); \
+            std::abort();                                                                   \
+        }                                                                                   \
+    } while (0)
+
+#endif
@@ -0,0 +1,315 @@
+//destroy() of blocked routines regressions
+//g++ -std=c++14 -O2 -I.. destroy.cpp -o destroy -lpthread && ./destroy
+#include "coroutine.h"
+#include "check.h"
+#include <atomic>
+#include <cstdio>
+#include <mutex>
+#include <sys/socket.h>
+#include <thread>
+#include <unistd.h>
+
+//counts live copies, an element dropped with its popper must be destroyed.
+//A moved-from one does not count, it may be left in a frame destroy() does
+//not unwind.
+struct Counted {
+    static std::atomic<int> live;
+    bool owns;
+
+    Counted()
+        : owns(true) {
+        ++live;
+    }
+
+    Counted(const Counted&)
+        : owns(true) {
+        ++live;
+    }
+
+    Counted(Counted&& other)
+        : owns(other.owns) {
+        other.owns = false;
+    }
+
+    Counted& operator=(const Counted&) {
+        return *this;
+    }
+
+    ~Counted() {
+        if (owns) {
+            --live;
+        }
+    }
+};
+
+std::atomic<int> Counted::live(0);
+
+//a popper destroyed while blocked is unlinked, the next push goes to the
+//popper after it and run() does not wait for the destroyed one
+static void destroy_blocked_popper() {
+    coroutine::Channel<int> channel(coroutine::Capacity(4));
+    int got = -1;
+    coroutine::routine_t blocked = coroutine::spawn([&channel] {
+        channel.pop();
+    });
+    coroutine::resume(blocked);
+    coroutine::routine_t popper = coroutine::spawn([&] {
+        got = channel.pop();
+    });
+    coroutine::resume(popper);
+    coroutine::destroy(blocked);
+    channel.push(5);
+    coroutine::run();
+    CHECK(got == 5 && channel.empty());
+}
+
+//destroyed after an element was handed to it but before it ran: the
+//element goes with it, the cell is free again
+static void destroy_handed_off_popper() {
+    {
+        coroutine::Channel<Counted> channel(coroutine::Capacity(2));
+        coroutine::routine_t popper = coroutine::spawn([&channel] {
+            channel.pop();
+        });
+        coroutine::resume(popper);
+        channel.push(Counted());
+        coroutine::destroy(popper);
+        CHECK(Counted::live == 0 && channel.empty());
+        channel.push(Counted());
+        channel.push(Counted());
+        Counted out;
+        CHECK(channel.try_pop(out) && channel.size() == 1);
+        coroutine::run();
+    }
+    CHECK(Counted::live == 0);
+}
+
+//a select woken and then destroyed passes the wakeup on to the next popper
+static void destroy_selecting() {
+    coroutine::Channel<int> a(coroutine::Capacity(4)), b(coroutine::Capacity(4));
+    int unused = -1, got = -1;
+    coroutine::routine_t selecting = coroutine::spawn([&] {
+        coroutine::select(coroutine::on_pop(a, unused), coroutine::on_pop(b, unused));
+    });
+    coroutine::resume(selecting);
+    coroutine::routine_t popper = coroutine::spawn([&] {
+        got = a.pop();
+    });
+    coroutine::resume(popper);
+    a.push(1);
+    coroutine::destroy(selecting);
+    coroutine::run();
+    CHECK(got == 1 && unused == -1 && a.empty() && b.empty());
+}
+
+//a push from another thread races the destroy: the element ends up in the
+//channel or dropped with the popper, never both or lost
+static void destroy_racing_push() {
+    for (int i = 0; i < 500; ++i) {
+        {
+            coroutine::Channel<Counted> channel(coroutine::Capacity(2));
+            coroutine::routine_t popper = coroutine::spawn([&channel] {
+                channel.pop();
+            });
+            coroutine::resume(popper);
+            std::thread pusher([&channel] {
+                channel.push(Counted());
+            });
+            if (i % 2 == 0) {
+                std::this_thread::yield();
+            }
+            coroutine::destroy(popper);
+            pusher.join();
+            CHECK(Counted::live == int(channel.size()));
+            coroutine::run();
+        }
+        CHECK(Counted::live == 0);
+    }
+}
+
+//wait until the pool threads are done with whatever Counted they hold
+static bool all_released() {
+    for (int i = 0; i < 1000 && Counted::live != 0; ++i) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+    return Counted::live == 0;
+}
+
+//a waiter destroyed while blocked in a Mutex, Semaphore or CondVar, or
+//after it was signalled but before it ran: the next waiter gets through
+static void destroy_lock_waiters() {
+    for (int signalled = 0; signalled < 2; ++signalled) {
+        coroutine::Mutex mutex;
+        bool locked = false;
+        mutex.lock();
+        coroutine::routine_t first = coroutine::spawn([&mutex] {
+            mutex.lock();
+        });
+        coroutine::resume(first);
+        coroutine::resume(coroutine::spawn([&] {
+            std::lock_guard<coroutine::Mutex> lock(mutex);
+            locked = true;
+        }));
+        if (signalled) {
+            mutex.unlock();
+            coroutine::destroy(first);
+        } else {
+            coroutine::destroy(first);
+            mutex.unlock();
+        }
+        coroutine::run();
+        CHECK(locked && mutex.try_lock());
+        mutex.unlock();
+
+        coroutine::Semaphore semaphore;
+        bool acquired = false;
+        first = coroutine::spawn([&semaphore] {
+            semaphore.acquire();
+        });
+        coroutine::resume(first);
+        coroutine::resume(coroutine::spawn([&] {
+            semaphore.acquire();
+            acquired = true;
+        }));
+        if (signalled) {
+            semaphore.release();
+            coroutine::destroy(first);
+        } else {
+            coroutine::destroy(first);
+            semaphore.release();
+        }
+        coroutine::run();
+        CHECK(acquired && semaphore.count() == 0);
+
+        coroutine::CondVar ready;
+        bool notified = false;
+        first = coroutine::spawn([&] {
+            std::unique_lock<coroutine::Mutex> lock(mutex);
+            ready.wait(lock);
+        });
+        coroutine::resume(first);
+        coroutine::resume(coroutine::spawn([&] {
+            std::unique_lock<coroutine::Mutex> lock(mutex);
+            ready.wait(lock);
+            notified = true;
+        }));
+        if (signalled) {
+            ready.notify_one();
+            coroutine::destroy(first);
+        } else {
+            coroutine::destroy(first);
+            ready.notify_one();
+        }
+        coroutine::run();
+        CHECK(notified);
+
+        coroutine::WaitGroup group;
+        group.add();
+        first = coroutine::spawn([&group] {
+            group.wait();
+        });
+        coroutine::resume(first);
+        coroutine::destroy(first);
+        group.done();
+        coroutine::run();
+    }
+}
+
+//destroyed while await() runs its call, or after the call returned but
+//before the routine ran: the task is freed either way, run() returns
+static void destroy_awaiting() {
+    for (int returned = 0; returned < 2; ++returned) {
+        coroutine::routine_t awaiting = coroutine::spawn([returned] {
+            auto call = [counted = Counted(), returned] {
+                if (!returned) {
+                    std::this_thread::sleep_for(std::chrono::milliseconds(20));
+                }
+                return 1;
+            };
+            coroutine::await(std::move(call));
+        });
+        coroutine::resume(awaiting);
+        if (returned) {
+            std::this_thread::sleep_for(std::chrono::milliseconds(20));
+        }
+        coroutine::destroy(awaiting);
+        coroutine::run();
+    }
+    CHECK(all_released());
+}
+
+//offload() is shielded: destroy() waits for the call, then frees the task
+//a shared-stack routine kept on the heap
+static void destroy_offloading() {
+    bool called = false;
+    coroutine::RoutineOptions options;
+    options.shared_stack = true;
+    coroutine::routine_t offloading = coroutine::spawn([&called] {
+        auto call = [counted = Counted(), &called] {
+            std::this_thread::sleep_for(std::chrono::milliseconds(20));
+            called = true;
+        };
+        coroutine::offload(coroutine::cpu_pool(), std::move(call));
+    }, options);
+    coroutine::resume(offloading);
+    coroutine::destroy(offloading);
+    CHECK(called);
+    coroutine::run();
+    CHECK(all_released());
+}
+
+//a reader destroyed in wait_readable() gives up the descriptor, the next
+//reader of it is not refused and wakes
+static void destroy_fd_waiter() {
+    int fds[2];
+    CHECK(socketpair(AF_UNIX, SOCK_STREAM, 0, fds) == 0);
+    coroutine::routine_t first = coroutine::spawn([&fds] {
+        coroutine::wait_readable(fds[0]);
+    });
+    coroutine::resume(first);
+    coroutine::destroy(first);
+    int result = -1;
+    coroutine::resume(coroutine::spawn([&] {
+        result = coroutine::wait_readable(fds[0]);
+    }));
+    CHECK(::write(fds[1], "x", 1) == 1);
+    coroutine::run();
+    CHECK(result == 0);
+    ::close(fds[0]);
+    ::close(fds[1]);
+}
+
+//a joiner destroyed while parked on a future neither gets woken nor keeps
+//the next joiner out
+static void destroy_joiner() {
+    coroutine::Channel<int> channel(coroutine::Capacity(2));
+    coroutine::Future<int> future = coroutine::async([&channel] {
+        return channel.pop();
+    });
+    coroutine::routine_t first = coroutine::spawn([&future] {
+        future.wait();
+    });
+    coroutine::resume(first);
+    coroutine::destroy(first);
+    int got = 0;
+    coroutine::spawn([&] {
+        got = future.get();
+    });
+    channel.push(6);
+    coroutine::run();
+    CHECK(got == 6);
+}
+
+int main() {
+    destroy_blocked_popper();
+    destroy_handed_off_popper();
+    destroy_selecting();
+    destroy_racing_push();
+    destroy_lock_waiters();
+    destroy_awaiting();
+    destroy_offloading();
+    destroy_fd_waiter();
+    destroy_joiner();
+    std::printf("destroy ok\n");
+    return 0;
+}
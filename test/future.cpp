@@ -0,0 +1,68 @@
+//async()/Future regressions
+//g++ -std=c++14 -O2 -I.. future.cpp -o future -lpthread && ./future
+#include "coroutine.h"
+#include "check.h"
+#include <cstdio>
+#include <system_error>
+
+//get() on the future of a cancelled routine fails with FutureCancelled, the
+//joiner is not cancelled by it and keeps running
+static void joiner_of_cancelled_future_runs_on() {
+    coroutine::Channel<int> never(coroutine::Capacity(2));
+    coroutine::routine_t worker = 0;
+    bool failed = false, after = false;
+    coroutine::spawn([&] {
+        coroutine::Future<int> future = coroutine::async([&] {
+            worker = coroutine::current();
+            return never.pop();
+        });
+        try {
+            future.get();
+        } catch (const coroutine::Cancelled&) {
+            CHECK(false);
+        } catch (const coroutine::FutureCancelled&) {
+            failed = true;
+        }
+        coroutine::yield();
+        after = true;
+    });
+    coroutine::spawn([&] {
+        while (worker == 0) {
+            coroutine::yield();
+        }
+        coroutine::cancel(worker);
+    });
+    coroutine::run();
+    CHECK(failed && after);
+}
+
+//a second routine waiting for the same future is refused, the first one
+//still gets the value
+static void second_joiner_refused() {
+    coroutine::Channel<int> channel(coroutine::Capacity(2));
+    coroutine::Future<int> future = coroutine::async([&channel] {
+        return channel.pop();
+    });
+    int got = 0;
+    bool refused = false;
+    coroutine::spawn([&] {
+        got = future.get();
+    });
+    coroutine::spawn([&] {
+        try {
+            future.wait();
+        } catch (const std::system_error& error) {
+            refused = error.code() == std::errc::device_or_resource_busy;
+        }
+        channel.push(4);
+    });
+    coroutine::run();
+    CHECK(refused && got == 4);
+}
+
+int main() {
+    joiner_of_cancelled_future_runs_on();
+    second_joiner_refused();
+    std::printf("future ok\n");
+    return 0;
+}
@@ -0,0 +1,35 @@
+//Generator regressions
+//g++ -std=c++14 -O2 -I.. generator.cpp -o generator -lpthread && ./generator
+#include "coroutine.h"
+#include "check.h"
+#include <cstdio>
+
+//a dropped generator whose body catches Cancelled once and yields again is
+//still unwound to its end
+static void dropped_body_that_catches_cancelled() {
+    bool unwound = false;
+    {
+        coroutine::Generator<int> numbers([&unwound](coroutine::Yield<int>& yield) {
+            try {
+                yield(1);
+            } catch (const coroutine::Cancelled&) {
+            }
+            try {
+                yield(2);
+            } catch (const coroutine::Cancelled&) {
+                unwound = true;
+                throw;
+            }
+        });
+        int value = 0;
+        bool more = numbers.next(value);
+        CHECK(more && value == 1);
+    }
+    CHECK(unwound);
+}
+
+int main() {
+    dropped_body_that_catches_cancelled();
+    std::printf("generator ok\n");
+    return 0;
+}
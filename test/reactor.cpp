@@ -0,0 +1,115 @@
+//reactor regressions
+//g++ -std=c++14 -O2 -I.. reactor.cpp -o reactor -lpthread && ./reactor
+#include "coroutine.h"
+#include "check.h"
+#include <cstdio>
+#include <cstring>
+#include <fcntl.h>
+#include <sys/socket.h>
+#include <thread>
+#include <unistd.h>
+
+static void nonblocking(int fd) {
+    ::fcntl(fd, F_SETFL, ::fcntl(fd, F_GETFL) | O_NONBLOCK);
+}
+
+//two routines of one thread echo over a socket pair, each suspending in
+//read() until the other has written
+static void echo_between_routines() {
+    int fds[2];
+    int result = ::socketpair(AF_UNIX, SOCK_STREAM, 0, fds);
+    CHECK(result == 0);
+    nonblocking(fds[0]);
+    nonblocking(fds[1]);
+    const int rounds = 1000;
+    int echoed = 0;
+    coroutine::spawn([&] {
+        char buffer[16];
+        ssize_t n;
+        while ((n = coroutine::read(fds[1], buffer, sizeof(buffer))) > 0) {
+            coroutine::write(fds[1], buffer, size_t(n));
+        }
+        ::close(fds[1]);
+    });
+    coroutine::spawn([&] {
+        for (int i = 0; i < rounds; ++i) {
+            char out[16];
+            char in[16];
+            int length = std::snprintf(out, sizeof(out), "%d", i);
+            coroutine::write(fds[0], out, size_t(length));
+            ssize_t n = coroutine::read(fds[0], in, sizeof(in));
+            if (n == length && std::memcmp(in, out, size_t(length)) == 0) {
+                ++echoed;
+            }
+        }
+        ::shutdown(fds[0], SHUT_WR);
+    });
+    coroutine::run();
+    ::close(fds[0]);
+    CHECK(echoed == rounds);
+}
+
+//a routine waiting for a pipe is woken when another thread writes to it,
+//while the run loop sleeps in the poller
+static void woken_by_another_thread() {
+    int fds[2];
+    int result = ::pipe(fds);
+    CHECK(result == 0);
+    nonblocking(fds[0]);
+    char got = 0;
+    int ticks = 0;
+    coroutine::spawn([&] {
+        ssize_t n = coroutine::read(fds[0], &got, 1);
+        CHECK(n == 1);
+    });
+    coroutine::spawn([&] {
+        //runs while the reader waits, so the reader does not hold the thread
+        ++ticks;
+    });
+    std::thread writer([&] {
+        std::this_thread::sleep_for(std::chrono::milliseconds(20));
+        ssize_t n = ::write(fds[1], "x", 1);
+        (void)n;
+    });
+    coroutine::run();
+    writer.join();
+    ::close(fds[0]);
+    ::close(fds[1]);
+    CHECK(got == 'x' && ticks == 1);
+}
+
+//a second routine waiting for the same direction of a descriptor fails
+//with EBUSY instead of taking the first one's place
+static void second_waiter_is_refused() {
+    int fds[2];
+    int result = ::pipe(fds);
+    CHECK(result == 0);
+    nonblocking(fds[0]);
+    char got = 0;
+    int second = 0;
+    int error = 0;
+    coroutine::spawn([&] {
+        ssize_t n = coroutine::read(fds[0], &got, 1);
+        CHECK(n == 1);
+    });
+    coroutine::spawn([&] {
+        char other;
+        second = int(coroutine::read(fds[0], &other, 1));
+        error = errno;
+        ssize_t n = ::write(fds[1], "y", 1);
+        CHECK(n == 1);
+    });
+    coroutine::run();
+    ::close(fds[0]);
+    ::close(fds[1]);
+    CHECK(second == -1 && error == EBUSY);
+    CHECK(got == 'y');
+}
+
+int main() {
+    echo_between_routines();
+    woken_by_another_thread();
+    second_waiter_is_refused();
+    std::printf("reactor ok\n");
+    return 0;
+}
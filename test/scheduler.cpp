@@ -0,0 +1,88 @@
+//Scheduler regressions
+//g++ -std=c++14 -O2 -I.. scheduler.cpp -o scheduler -lpthread && ./scheduler
+#include "coroutine.h"
+#include <atomic>
+#include "check.h"
+#include <cstdio>
+#include <thread>
+
+//every routine runs to its end across yields, wait() returns after the last
+static void routines_run_to_completion() {
+    std::atomic<int> done(0);
+    {
+        coroutine::Scheduler scheduler(4);
+        for (int i = 0; i < 10000; ++i) {
+            scheduler.spawn([&done] {
+                for (int j = 0; j < 4; ++j) {
+                    coroutine::yield();
+                }
+                done.fetch_add(1, std::memory_order_relaxed);
+            });
+        }
+        scheduler.wait();
+        CHECK(done.load() == 10000);
+    }
+}
+
+//routines spawn more routines from inside the workers
+static void nested_spawns() {
+    std::atomic<int> done(0);
+    coroutine::Scheduler scheduler(3);
+    for (int i = 0; i < 100; ++i) {
+        scheduler.spawn([&scheduler, &done] {
+            for (int j = 0; j < 10; ++j) {
+                scheduler.spawn([&done] {
+                    done.fetch_add(1, std::memory_order_relaxed);
+                });
+                coroutine::yield();
+            }
+        });
+    }
+    scheduler.wait();
+    CHECK(done.load() == 1000);
+}
+
+//routines blocked in a channel are woken by a thread outside the scheduler
+//and by each other, with nothing lost
+static void wakeups_across_threads() {
+    coroutine::Channel<int> in(coroutine::Capacity(8)), out(coroutine::Capacity(8));
+    std::atomic<long> sum(0);
+    const int consumers = 16;
+    const int count = 20000;
+    coroutine::Scheduler scheduler(4);
+    for (int i = 0; i < consumers; ++i) {
+        scheduler.spawn([&] {
+            for (;;) {
+                int value = in.pop();
+                if (value < 0) {
+                    break;
+                }
+                out.push(value);
+            }
+        });
+    }
+    scheduler.spawn([&] {
+        for (int i = 0; i < count; ++i) {
+            sum.fetch_add(out.pop(), std::memory_order_relaxed);
+        }
+    });
+    std::thread producer([&] {
+        for (int i = 0; i < count; ++i) {
+            in.push(i);
+        }
+        for (int i = 0; i < consumers; ++i) {
+            in.push(-1);
+        }
+    });
+    producer.join();
+    scheduler.wait();
+    CHECK(sum.load() == long(count) * (count - 1) / 2);
+}
+
+int main() {
+    routines_run_to_completion();
+    nested_spawns();
+    wakeups_across_threads();
+    std::printf("scheduler ok\n");
+    return 0;
+}
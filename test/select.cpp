@@ -0,0 +1,61 @@
+//select() regressions
+//g++ -std=c++14 -O2 -I.. select.cpp -o select -lpthread && ./select
+#include "coroutine.h"
+#include "check.h"
+#include <cstdio>
+#include <thread>
+
+//a select woken by a channel that completes on another one must pass the
+//wakeup on, or the next waiter of the first channel stays parked
+static void woken_pop_passed_on() {
+    coroutine::Channel<int> a(coroutine::Capacity(4)), b(coroutine::Capacity(4));
+    int got_select = -1, got_pop = -1, which = -1;
+    coroutine::spawn([&] {
+        which = coroutine::select(coroutine::on_pop(b, got_select), coroutine::on_pop(a, got_select));
+    });
+    coroutine::spawn([&] {
+        got_pop = a.pop();
+    });
+    coroutine::spawn([&] {
+        a.push(1);
+        b.push(2);
+    });
+    coroutine::run();
+    CHECK(which == 0 && got_select == 2);
+    CHECK(got_pop == 1 && a.size() == 0);
+}
+
+static void woken_push_passed_on() {
+    coroutine::Channel<int> a(coroutine::Capacity(2)), b(coroutine::Capacity(2));
+    for (int i = 0; i < 2; ++i) {
+        a.push(0);
+        b.push(0);
+    }
+    int which = -1;
+    bool pushed = false;
+    coroutine::spawn([&] {
+        which = coroutine::select(coroutine::on_push(b, 2), coroutine::on_push(a, 1));
+    });
+    coroutine::spawn([&] {
+        a.push(1);
+        pushed = true;
+    });
+    coroutine::spawn([&] {
+        a.pop();
+        b.pop();
+    });
+    coroutine::run();
+    CHECK(which == 0 && pushed && a.size() == 2);
+}
+
+//every test on a thread of its own, so its first select tries case 0 first
+static void run_test(void (*test)()) {
+    std::thread(test).join();
+}
+
+int main() {
+    run_test(woken_pop_passed_on);
+    run_test(woken_push_passed_on);
+    std::printf("select ok\n");
+    return 0;
+}
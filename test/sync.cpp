@@ -0,0 +1,152 @@
+//Mutex/CondVar/Semaphore/WaitGroup regressions
+//g++ -std=c++14 -O2 -I.. sync.cpp -o sync -lpthread && ./sync
+#include "coroutine.h"
+#include "check.h"
+#include <atomic>
+#include <cstdio>
+#include <deque>
+#include <thread>
+
+using Clock = std::chrono::steady_clock;
+using std::chrono::milliseconds;
+
+//a Mutex held across yields on scheduler workers and taken by a thread
+//outside routines: no increment is lost
+static void mutex_across_workers() {
+    coroutine::Mutex mutex;
+    long count = 0;
+    {
+        coroutine::Scheduler scheduler(4);
+        for (int i = 0; i < 64; ++i) {
+            scheduler.spawn([&] {
+                for (int j = 0; j < 200; ++j) {
+                    std::lock_guard<coroutine::Mutex> lock(mutex);
+                    ++count;
+                    if (j % 50 == 0) {
+                        coroutine::yield();
+                    }
+                }
+            });
+        }
+        for (int j = 0; j < 1000; ++j) {
+            std::lock_guard<coroutine::Mutex> lock(mutex);
+            ++count;
+        }
+        scheduler.wait();
+    }
+    CHECK(count == 64 * 200 + 1000);
+}
+
+//consumers wait for jobs under the predicate, every job is taken once and
+//a wait nobody notifies times out
+static void condvar_jobs() {
+    coroutine::Mutex mutex;
+    coroutine::CondVar ready;
+    std::deque<int> jobs;
+    int taken = 0;
+    bool stop = false;
+    for (int i = 0; i < 4; ++i) {
+        coroutine::spawn([&] {
+            std::unique_lock<coroutine::Mutex> lock(mutex);
+            for (;;) {
+                ready.wait(lock, [&] { return stop || !jobs.empty(); });
+                if (jobs.empty()) {
+                    return;
+                }
+                jobs.pop_front();
+                ++taken;
+            }
+        });
+    }
+    coroutine::spawn([&] {
+        for (int i = 0; i < 100; ++i) {
+            {
+                std::lock_guard<coroutine::Mutex> lock(mutex);
+                jobs.push_back(i);
+            }
+            ready.notify_one();
+            if (i % 10 == 0) {
+                coroutine::yield();
+            }
+        }
+        std::lock_guard<coroutine::Mutex> lock(mutex);
+        stop = true;
+        ready.notify_all();
+    });
+    bool notified = true;
+    Clock::duration waited;
+    coroutine::spawn([&] {
+        std::unique_lock<coroutine::Mutex> lock(mutex);
+        Clock::time_point start = Clock::now();
+        notified = ready.wait_for(lock, milliseconds(20), [] { return false; });
+        waited = Clock::now() - start;
+    });
+    coroutine::run();
+    CHECK(taken == 100 && jobs.empty());
+    CHECK(!notified && waited >= milliseconds(20));
+}
+
+//acquire_for() times out on an empty semaphore, a release() from another
+//thread lets exactly that many blocked routines through
+static void semaphore_timeout_and_release() {
+    coroutine::Semaphore semaphore;
+    bool acquired = true;
+    Clock::duration waited;
+    coroutine::spawn([&] {
+        Clock::time_point start = Clock::now();
+        acquired = semaphore.acquire_for(milliseconds(20));
+        waited = Clock::now() - start;
+    });
+    coroutine::run();
+    CHECK(!acquired && waited >= milliseconds(20));
+
+    std::atomic<int> through(0);
+    for (int i = 0; i < 5; ++i) {
+        coroutine::spawn([&] {
+            semaphore.acquire();
+            ++through;
+        });
+    }
+    std::thread releaser([&] {
+        std::this_thread::sleep_for(milliseconds(10));
+        semaphore.release(3);
+        std::this_thread::sleep_for(milliseconds(10));
+        semaphore.release(2);
+    });
+    coroutine::run();
+    releaser.join();
+    CHECK(through == 5 && semaphore.count() == 0);
+}
+
+//wait() returns once every add() is matched by a done(), in a routine and
+//in the main context whose routines run meanwhile
+static void wait_group() {
+    coroutine::WaitGroup group;
+    int finished = 0;
+    bool waited = false;
+    group.add(10);
+    for (int i = 0; i < 10; ++i) {
+        coroutine::spawn([&group, &finished, i] {
+            coroutine::sleep_for(milliseconds(i));
+            ++finished;
+            group.done();
+        });
+    }
+    coroutine::spawn([&] {
+        group.wait();
+        waited = finished == 10;
+    });
+    group.wait();
+    CHECK(finished == 10);
+    coroutine::run();
+    CHECK(waited);
+}
+
+int main() {
+    mutex_across_workers();
+    condvar_jobs();
+    semaphore_timeout_and_release();
+    wait_group();
+    std::printf("sync ok\n");
+    return 0;
+}
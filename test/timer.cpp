@@ -0,0 +1,104 @@
+//timer regressions
+//g++ -std=c++14 -O2 -I.. timer.cpp -o timer -lpthread && ./timer
+#include "coroutine.h"
+#include "check.h"
+#include <atomic>
+#include <cstdio>
+#include <thread>
+#include <vector>
+
+using Clock = std::chrono::steady_clock;
+using std::chrono::milliseconds;
+
+//sleepers wake in deadline order, not in the order they went to sleep,
+//and run() waits for them
+static void sleepers_wake_in_deadline_order() {
+    std::vector<int> order;
+    const int delays[] = { 30, 10, 20, 0 };
+    for (int delay : delays) {
+        coroutine::spawn([&order, delay] {
+            coroutine::sleep_for(milliseconds(delay));
+            order.push_back(delay);
+        });
+    }
+    Clock::time_point start = Clock::now();
+    coroutine::run();
+    CHECK(Clock::now() - start >= milliseconds(30));
+    CHECK((order == std::vector<int>{ 0, 10, 20, 30 }));
+}
+
+//a timed pop fires on an empty channel, and returns the element when one
+//arrives from another thread in time
+static void timed_pop_fires_and_is_beaten() {
+    coroutine::Channel<int> channel(coroutine::Capacity(4));
+    bool first = true;
+    bool second = false;
+    int value = 0;
+    Clock::duration waited;
+    coroutine::spawn([&] {
+        Clock::time_point start = Clock::now();
+        first = channel.pop_for(value, milliseconds(20));
+        waited = Clock::now() - start;
+        second = channel.pop_for(value, std::chrono::seconds(10));
+    });
+    std::thread pusher([&] {
+        std::this_thread::sleep_for(milliseconds(60));
+        channel.push(7);
+    });
+    coroutine::run();
+    pusher.join();
+    CHECK(!first && waited >= milliseconds(20));
+    CHECK(second && value == 7);
+}
+
+//park_until() times out unless woken first
+static void park_until_times_out_or_is_woken() {
+    bool timed = true;
+    bool woken = false;
+    coroutine::routine_t parked = coroutine::spawn([&] {
+        timed = coroutine::park_until(Clock::now() + milliseconds(10));
+        woken = coroutine::park_until(Clock::now() + std::chrono::seconds(10));
+    });
+    coroutine::spawn([&] {
+        coroutine::sleep_for(milliseconds(30));
+        coroutine::wake(parked);
+    });
+    Clock::time_point start = Clock::now();
+    coroutine::run();
+    CHECK(!timed && woken);
+    CHECK(Clock::now() - start < std::chrono::seconds(5));
+}
+
+//scheduled routines sleep on the scheduler's timers, the workers go on
+//running the others meanwhile
+static void scheduled_sleepers() {
+    std::atomic<int> woke(0);
+    std::atomic<int> ran(0);
+    Clock::time_point start = Clock::now();
+    {
+        coroutine::Scheduler scheduler(2);
+        for (int i = 0; i < 100; ++i) {
+            scheduler.spawn([&woke, i] {
+                coroutine::sleep_for(milliseconds(10 + i % 10));
+                woke.fetch_add(1, std::memory_order_relaxed);
+            });
+        }
+        for (int i = 0; i < 100; ++i) {
+            scheduler.spawn([&ran] {
+                ran.fetch_add(1, std::memory_order_relaxed);
+            });
+        }
+        scheduler.wait();
+    }
+    CHECK(woke.load() == 100 && ran.load() == 100);
+    CHECK(Clock::now() - start >= milliseconds(19));
+}
+
+int main() {
+    sleepers_wake_in_deadline_order();
+    timed_pop_fires_and_is_beaten();
+    park_until_times_out_or_is_woken();
+    scheduled_sleepers();
+    std::printf("timer ok\n");
+    return 0;
+}